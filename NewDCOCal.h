@@ -3,63 +3,419 @@
 
  New calibration data for the DCO
 
- */
+ The calibrated frequencies are declared only once in NCAL_FREQ_LIST.
+ Each NCAL_FREQ_LIST entry X(kHz,name,pos) gives the frequency in kHz
+ (decimals are allowed, as 7372.8), the name used to access it and
+ the position of its DCOCTL byte in Segment B (BCSCTL1 is the next):
 
-#include <iomacros.h>
+     NCALDCO(name)   DCOCTL  calibration data
+     NCALBC1(name)   BCSCTL1 calibration data
+     NCALDCO_name    The same data with the original names
+     NCALBC1_name
+
+ Frequencies must be in rising order. The positions go down from
+ NCAL_TOP_ in any order without gaps. The default list keeps the
+ original layout, 1MHz at 0x10BE up to 16MHz at 0x10B0 and 500kHz
+ at 0x10AE, so older calibrated boards and programs still work.
+ Segment B starts with a header written after the data:
+
+     NCAL_HEAD_  NCAL_TAG + NCAL_LEN*256 (data length in bytes)
+     NCAL_CRC_   CRC-16 (CCITT) of the data words from the lowest one
+
+ The data is only valid if the header and the CRC are correct. All
+ the flash data (header, records and map) is read in uint16_t words.
+
+ The runtime library at the end of this file switches the DCO to
+ a calibrated frequency and gives the flash and delay constants
+ for it. Example:
+
+     if (ncal_valid())
+         {
+         DCO_SET(8MHZ);
+         FCTL2=NCAL_FCTL2(8MHZ);
+         __delay_cycles(NCAL_CYCLES(8MHZ,100));   // 100us
+         }
+
+ With temperature bins each bin has its own set of data, header and
+ CRC in the fixed layout 64 bytes lower than the previous bin. Bin 0
+ is in Segment B, bin 1 in Segment C and bin 2 in Segment D:
+
+     bin=ncal_bin(ncal_temp_adc());
+     if (ncal_valid_bin(bin)) DCO_SET_BIN(bin,8MHZ);
+
+ With the dense DCO map any frequency can be set without measuring:
+
+     if (!ncal_map_set(7372800UL)) DCO_SET(8MHZ);
+
+ */
 
 // Test ton include the file only one time
 #ifndef _NEW_DCO_CAL_
 #define _NEW_DCO_CAL_
 
-#define NCALDCO_500kHZ_        0x10AE    /* DCOCTL  Calibration Data for 500kHz */
-const_sfrb(NCALDCO_500kHZ, NCALDCO_500kHZ_);
-#define NCALBC1_500kHZ_        0x10AF    /* BCSCTL1 Calibration Data for 500kHz */
-const_sfrb(NCALBC1_500kHZ, NCALBC1_500kHZ_);
+#include <msp430.h>
+#include <iomacros.h>
+#include <stdint.h>          // Flash data is in 16-bit words
+
+// Frequencies to calibrate: X(kHz,name,DCOCTL position)
+#define NCAL_FREQ_LIST(X)           \
+        X(500   ,500kHZ ,0x10AE)    \
+        X(1000  ,1MHZ   ,0x10BE)    \
+        X(2000  ,2MHZ   ,0x10BC)    \
+        X(4000  ,4MHZ   ,0x10BA)    \
+        X(6000  ,6MHZ   ,0x10B8)    \
+        X(8000  ,8MHZ   ,0x10B6)    \
+        X(10000 ,10MHZ  ,0x10B4)    \
+        X(12000 ,12MHZ  ,0x10B2)    \
+        X(16000 ,16MHZ  ,0x10B0)
+
+#define NCAL_TOP_        0x10BE    /* Highest DCOCTL position */
+#define NCAL_MAX         30        /* Segment B has 64 bytes with the header */
+
+// Data header
+#define NCAL_HEAD_       0x1080    /* Tag and length */
+#define NCAL_CRC_        0x1082    /* CRC of the data */
+#define NCAL_TAG         0xDB
+#define NCAL_LEN         (2*NCAL_NFREQ)
+#define NCAL_HEAD        (NCAL_TAG+NCAL_LEN*256)
+
+// Index for each frequency and number of frequencies
+#define NCAL_ENUM_(k,name,pos) NCAL_IDX_##name,
+enum { NCAL_FREQ_LIST(NCAL_ENUM_) NCAL_NFREQ };
+
+// Slot of each frequency, 0 at NCAL_TOP_ and going down
+#define NCAL_SLOT_ENUM_(k,name,pos) NCAL_SLOT_##name=(NCAL_TOP_-(pos))/2,
+enum { NCAL_FREQ_LIST(NCAL_SLOT_ENUM_) NCAL_SLOT_END_ };
+
+// Segment B must hold all the list
+typedef char NcalListFits[(NCAL_NFREQ<=NCAL_MAX)?1:-1];
+
+// The slots must be 0 to NCAL_NFREQ-1, each one used once,
+// so the data has no gaps for the CRC
+#define NCAL_SLOT_BIT_(k,name,pos) |(1UL<<NCAL_SLOT_##name)
+typedef char NcalSlotsUsed[((0 NCAL_FREQ_LIST(NCAL_SLOT_BIT_))
+                            ==((1UL<<NCAL_NFREQ)-1))?1:-1];
+
+// Calibration data positions
+#define NCALDCO_POS(s)     (NCAL_TOP_-2*(s))      /* DCOCTL  of slot s */
+#define NCALBC1_POS(s)     (NCAL_TOP_-2*(s)+1)    /* BCSCTL1 of slot s */
+#define NCAL_LOW_          NCALDCO_POS(NCAL_NFREQ-1)  /* Lowest data word */
+#define NCAL_BIN_OFS(bin)  (64*(bin))             /* Temperature bin offset */
+
+// Calibration data access by name
+#define NCALDCO(name) (*(const volatile unsigned char *)NCALDCO_POS(NCAL_SLOT_##name))
+#define NCALBC1(name) (*(const volatile unsigned char *)NCALBC1_POS(NCAL_SLOT_##name))
+
+// Original names, NCALDCO_1MHZ and NCALBC1_1MHZ for 1MHZ
+#define NCAL_SFR_(k,name,pos) const_sfrb(NCALDCO_##name,pos); \
+                              const_sfrb(NCALBC1_##name,pos+1);
+NCAL_FREQ_LIST(NCAL_SFR_)
+
+/*
+ Calibration records (APPEND_RECORDS mode)
+
+ Instead of the fixed positions, new calibrations can be appended as
+ records in Segments B, C and D. Records fill Segment B first, then
+ C and D, and never cross a segment. The data is in words:
+
+     0       NCAL_REC_TAG + NCAL_REC_LEN*256
+     1,2     Set of calibrated frequencies (bit i for entry i)
+     3       Record counter, the highest one is the newest
+     4..     DCOCTL + BCSCTL1*256 for each frequency
+     last    CRC-16 (CCITT) of the previous words, written last
+
+ A record is valid only if its header and CRC are correct.
+ */
+
+#define NCAL_REC_TAG     0xDC      /* Record tag */
+#define NCAL_REC_WORDS   (5+NCAL_NFREQ)
+#define NCAL_REC_LEN     (2*NCAL_REC_WORDS)           /* Bytes */
+#define NCAL_REC_HEAD    (NCAL_REC_TAG+NCAL_REC_LEN*256)
+#define NCAL_REC_DATA    4         /* First data word */
+#define NCAL_REC_SEG     0x1080    /* First segment (B), C and D follow down */
+#define NCAL_REC_NSEG    3
+#define NCAL_REC_PER_SEG (64/NCAL_REC_LEN)
+#define NCAL_REC_SLOTS   (NCAL_REC_NSEG*NCAL_REC_PER_SEG)
+
+// Position of record slot k
+#define NCAL_REC_POS(k)  (NCAL_REC_SEG-64*((k)/NCAL_REC_PER_SEG) \
+                          +NCAL_REC_LEN*((k)%NCAL_REC_PER_SEG))
+
+/*
+ Runtime library
+
+ dco_set first sets DCOCTL to its lowest value, then BCSCTL1 and then
+ DCOCTL. This way the DCO never goes over the old or the new frequency
+ when RSEL changes in any direction. The ACLK divider is kept.
+ */
+
+// Frequency of each entry in kHz (integer part)
+#define NCAL_KHZ_ENUM_(k,name,pos) NCAL_KHZ_##name=(int)(k),
+enum { NCAL_FREQ_LIST(NCAL_KHZ_ENUM_) NCAL_KHZ_END_ };
+
+// FCTL2 value for MCLK at a calibrated frequency
+// fTG is the highest one not over 476kHz
+// No divider is in spec for frequencies from 476 to 514kHz, then
+// NCAL_FCTL2 does not compile (negative array size)
+#define NCAL_FN(name)     ((NCAL_KHZ_##name+475)/476-1)
+#define NCAL_FTG_OK(name) ((NCAL_KHZ_##name)/(NCAL_FN(name)+1)>=257)
+#define NCAL_FCTL2(name)  (FWKEY+FSSEL_1+NCAL_FN(name) \
+                           +0*sizeof(char[NCAL_FTG_OK(name)?1:-1]))
+
+// __delay_cycles count for us microseconds at a calibrated frequency
+#define NCAL_CYCLES(name,us) ((unsigned long)(us)*NCAL_KHZ_##name/1000)
+
+// Sets the DCO with a DCOCTL and BCSCTL1 calibration pair
+static inline void dco_set(unsigned char dco,unsigned char bc1)
+ {
+ DCOCTL=0;                                  // Lowest DCO and MOD
+ BCSCTL1=(BCSCTL1&(DIVA1+DIVA0))|bc1;       // New RSEL, same divider
+ DCOCTL=dco;
+ }
+
+// Sets a calibrated frequency from the fixed positions
+#define DCO_SET(name) dco_set(NCALDCO(name),NCALBC1(name))
+
+// CRC-16 (CCITT) of n words
+static inline uint16_t ncal_crc16(const uint16_t *p,int n)
+ {
+ int i;
+ uint16_t crc=0xFFFF;
+ const unsigned char *ptr;
+
+ ptr=(const unsigned char *) p;
+ n*=2;
+ while (n--)
+     {
+	 crc^=(*(ptr++))<<8;
+	 for(i=0;i<8;i++)
+		 crc=(crc&0x8000)?((crc<<1)^0x1021):(crc<<1);
+     }
+
+ return crc;
+ }
+
+// Checks the header of the fixed positions data of a temperature bin
+// Returns 1 if the tag and the CRC are correct
+static inline int ncal_valid_bin(int bin)
+ {
+ if ((*(const uint16_t *) (NCAL_HEAD_-NCAL_BIN_OFS(bin)))!=NCAL_HEAD) return 0;
+ return (ncal_crc16((const uint16_t *) (NCAL_LOW_-NCAL_BIN_OFS(bin)),
+		            NCAL_NFREQ)
+		 ==(*(const uint16_t *) (NCAL_CRC_-NCAL_BIN_OFS(bin))));
+ }
+
+// Checks the header of the fixed positions data
+#define ncal_valid() ncal_valid_bin(0)
+
+// Finds the newest valid calibration record
+// Returns its slot or -1 if there is none
+static inline int ncal_record(void)
+ {
+ int k,slot=-1;
+ const uint16_t *p,*rec=0;
+
+ for(k=0;k<NCAL_REC_SLOTS;k++)
+     {
+	 p=(const uint16_t *) NCAL_REC_POS(k);
+	 if (p[0]!=NCAL_REC_HEAD) continue;
+	 if (ncal_crc16(p,NCAL_REC_WORDS-1)!=p[NCAL_REC_WORDS-1]) continue;
+
+	 // Keep the highest counter
+	 if ((rec)&&(((int16_t)(p[3]-rec[3]))<=0)) continue;
+	 rec=p;
+	 slot=k;
+     }
+
+ return slot;
+ }
+
+// Sets a calibrated frequency from a record slot
+#define DCO_SET_REC(slot,name) \
+   dco_set(((const unsigned char *) NCAL_REC_POS(slot))[2*(NCAL_REC_DATA+NCAL_IDX_##name)], \
+           ((const unsigned char *) NCAL_REC_POS(slot))[2*(NCAL_REC_DATA+NCAL_IDX_##name)+1])
+
+/*
+ Temperature bins (TEMP_BINS mode)
+
+ The range from NCAL_TEMP_MIN to NCAL_TEMP_MAX degrees is divided in
+ NCAL_TEMP_BINS equal bins. Temperatures out of the range use the
+ first or last bin. The bins are compared in ADC10 codes of the
+ internal sensor with the 1.5V reference using the typical sensor
+ slope and offset. The chip offset is the same when calibrating and
+ when reading, so it only moves the bin limits a few degrees.
+ */
+
+#define NCAL_TEMP_BINS   3
+#define NCAL_TEMP_MIN    (-20)     /* Degrees C */
+#define NCAL_TEMP_MAX    60        /* Degrees C */
+
+// One bin for each of Segments B, C and D
+typedef char NcalBinsFit[(NCAL_TEMP_BINS<=3)?1:-1];
+
+// Typical ADC10 code for t degrees C
+#define NCAL_TEMP_CODE(t)   ((int)((t)*1024L/423+673))
+#define NCAL_CODE_MIN       NCAL_TEMP_CODE(NCAL_TEMP_MIN)
+#define NCAL_CODE_SPAN      (NCAL_TEMP_CODE(NCAL_TEMP_MAX)-NCAL_CODE_MIN)
+
+// Reads the internal temperature sensor once in about 80us
+// The ADC10 and its reference are turned off at the end
+// The reference settling time is for MCLK up to 16MHz
+static inline unsigned int ncal_temp_adc(void)
+ {
+ unsigned int code;
+
+ ADC10CTL1=INCH_10+ADC10DIV_3;                   // Sensor, ADC10OSC/4
+ ADC10CTL0=SREF_1+ADC10SHT_3+REFON+ADC10ON;      // 1.5V, 64 clocks (>30us)
+ __delay_cycles(480);                            // Reference settling
+ ADC10CTL0|=ENC+ADC10SC;                         // Start the conversion
+ while (ADC10CTL1&ADC10BUSY);
+ code=ADC10MEM;
+ ADC10CTL0&=~ENC;
+ ADC10CTL0=0;                                    // Reference and ADC off
+
+ return code;
+ }
+
+// Temperature bin of an ADC10 sensor code in constant time
+static inline int ncal_bin(unsigned int code)
+ {
+ int bin;
+
+ if ((int)code<=NCAL_CODE_MIN) return 0;
+ bin=(int)(((long)((int)code-NCAL_CODE_MIN)*NCAL_TEMP_BINS)/NCAL_CODE_SPAN);
+ return (bin<NCAL_TEMP_BINS)?bin:(NCAL_TEMP_BINS-1);
+ }
+
+// Sets a calibrated frequency from the fixed positions of a bin
+#define DCO_SET_BIN(bin,name) \
+   dco_set(((const unsigned char *) NCALDCO_POS(NCAL_SLOT_##name))[-NCAL_BIN_OFS(bin)], \
+           ((const unsigned char *) NCALBC1_POS(NCAL_SLOT_##name))[-NCAL_BIN_OFS(bin)])
+
+/*
+ Dense DCO map (MAP_BUILD mode)
+
+ Segments D and C (0x1000 to 0x107F) hold the measured frequency of
+ each RSEL and DCO point with MOD 0, from RSEL NCAL_MAP_RSEL0 up, in
+ log2(Hz) units of 1/256 (0.27%):
+
+     NCAL_MAP_     NCAL_MAP_TAG + length in bytes *256
+     NCAL_MAP_+2   CRC-16 (CCITT) of the data words
+     NCAL_MAP_+4   Value of the first point (RSEL0, DCO 0)
+     NCAL_MAP_+6   One signed byte for each next point in RSEL, DCO
+                   order with the difference to the previous one
+
+ The differences are encoded against the values the reader builds,
+ so the error does not add up and is under 1/2 unit for any point.
+ MOD mixes the periods of DCO and DCO+1, so the MOD slope of a point
+ is about the difference to the next DCO point divided by 32.
+ */
+
+#define NCAL_MAP_        0x1000    /* Map header in Segment D */
+#define NCAL_MAP_TAG     0xDD
+#define NCAL_MAP_RSEL0   1         /* First RSEL, RSEL 0 does not fit */
+#define NCAL_MAP_NPTS    ((16-NCAL_MAP_RSEL0)*8)
+#define NCAL_MAP_WORDS   ((NCAL_MAP_NPTS+3)/2)    /* First value and differences */
+#define NCAL_MAP_HEAD    (NCAL_MAP_TAG+2*NCAL_MAP_WORDS*256)
+
+// The map must fit in Segments D and C with its header
+typedef char NcalMapFits[(4+2*NCAL_MAP_WORDS<=128)?1:-1];
+
+// log2(x) in 1/512 units for x>0
+// The fraction is found bit by bit squaring the mantissa
+static inline int ncal_log2q9(unsigned long x)
+ {
+ int i,p=0;
+ unsigned long m;
+ int r;
 
-#define NCALDCO_16MHZ_         0x10B0    /* DCOCTL  Calibration Data for 16MHz */
-const_sfrb(NCALDCO_16MHZ, NCALDCO_16MHZ_);
-#define NCALBC1_16MHZ_         0x10B1    /* BCSCTL1 Calibration Data for 16MHz */
-const_sfrb(NCALBC1_16MHZ, NCALBC1_16MHZ_);
+ // Mantissa from 1 to 2 in 1/32768 units
+ for(m=x;m>1;m>>=1) p++;
+ m=(p>15)?(x>>(p-15)):(x<<(15-p));
 
-#define NCALDCO_12MHZ_         0x10B2    /* DCOCTL  Calibration Data for 12MHz */
-const_sfrb(NCALDCO_12MHZ, NCALDCO_12MHZ_);
-#define NCALBC1_12MHZ_         0x10B3    /* BCSCTL1 Calibration Data for 12MHz */
-const_sfrb(NCALBC1_12MHZ, NCALBC1_12MHZ_);
+ // 9 bits of fraction
+ r=0;
+ for(i=0;i<9;i++)
+     {
+	 m=(m*m)>>15;
+	 r<<=1;
+	 if (m>=65536UL)
+	     {
+		 m>>=1;
+		 r++;
+	     }
+     }
 
-#define NCALDCO_10MHZ_         0x10B4    /* DCOCTL  Calibration Data for 10MHz */
-const_sfrb(NCALDCO_10MHZ, NCALDCO_10MHZ_);
-#define NCALBC1_10MHZ_         0x10B5    /* BCSCTL1 Calibration Data for 10MHz */
-const_sfrb(NCALBC1_10MHZ, NCALBC1_10MHZ_);
+ return p*512+r;
+ }
 
-#define NCALDCO_8MHZ_         0x10B6    /* DCOCTL  Calibration Data for 8MHz */
-const_sfrb(NCALDCO_8MHZ, NCALDCO_8MHZ_);
-#define NCALBC1_8MHZ_         0x10B7    /* BCSCTL1 Calibration Data for 8MHz */
-const_sfrb(NCALBC1_8MHZ, NCALBC1_8MHZ_);
+// log2(x) in 1/256 units for x>0, rounded
+static inline int ncal_log2q8(unsigned long x)
+ {
+ return (ncal_log2q9(x)+1)>>1;
+ }
 
-#define NCALDCO_6MHZ_         0x10B8    /* DCOCTL  Calibration Data for 6MHz */
-const_sfrb(NCALDCO_6MHZ, NCALDCO_6MHZ_);
-#define NCALBC1_6MHZ_         0x10B9    /* BCSCTL1 Calibration Data for 6MHz */
-const_sfrb(NCALBC1_6MHZ, NCALBC1_6MHZ_);
+// Checks the header of the dense DCO map
+// Returns 1 if the tag and the CRC are correct
+static inline int ncal_map_valid(void)
+ {
+ if ((*(const uint16_t *) NCAL_MAP_)!=NCAL_MAP_HEAD) return 0;
+ return (ncal_crc16((const uint16_t *) (NCAL_MAP_+4),NCAL_MAP_WORDS)
+		 ==(*(const uint16_t *) (NCAL_MAP_+2)));
+ }
 
-#define NCALDCO_4MHZ_         0x10BA    /* DCOCTL  Calibration Data for 4MHz */
-const_sfrb(NCALDCO_4MHZ, NCALDCO_4MHZ_);
-#define NCALBC1_4MHZ_         0x10BB    /* BCSCTL1 Calibration Data for 4MHz */
-const_sfrb(NCALBC1_4MHZ, NCALBC1_4MHZ_);
+// Sets the DCO configuration nearest to hz from the dense map
+// Between the RSEL values that reach hz, the DCO nearest
+// to the middle of the range is used
+// Returns 0 if the map is not valid or hz is out of the map
+static inline int ncal_map_set(unsigned long hz)
+ {
+ const signed char *dp;
+ int k,t,l,l1,d,m,dist,bestDist=16;
+ unsigned char bestDco=0,bestBc1=0;
 
-#define NCALDCO_2MHZ_         0x10BC    /* DCOCTL  Calibration Data for 2MHz */
-const_sfrb(NCALDCO_2MHZ, NCALDCO_2MHZ_);
-#define NCALBC1_2MHZ_         0x10BD    /* BCSCTL1 Calibration Data for 2MHz */
-const_sfrb(NCALBC1_2MHZ, NCALBC1_2MHZ_);
+ if ((!hz)||(!ncal_map_valid())) return 0;
 
-#define NCALDCO_1MHZ_         0x10BE    /* DCOCTL  Calibration Data for 1MHz */
-const_sfrb(NCALDCO_1MHZ, NCALDCO_1MHZ_);
-#define NCALBC1_1MHZ_         0x10BF    /* BCSCTL1 Calibration Data for 1MHz */
-const_sfrb(NCALBC1_1MHZ, NCALBC1_1MHZ_);
+ // Values in 1/512 units to keep one more bit of hz
+ t=ncal_log2q9(hz);
+ l=2*(*(const int16_t *) (NCAL_MAP_+4));
+ dp=(const signed char *) (NCAL_MAP_+6);
 
+ for(k=0;k<NCAL_MAP_NPTS-1;k++)
+     {
+	 l1=l+2*dp[k];
+	 d=k&7;
 
+	 // Points k and k+1 have the same RSEL
+	 if ((d<7)&&(t>=l)&&(t<l1))
+	     {
+		 // MOD mixes periods, not log2 values, so the linear
+		 // position is corrected with the second order term
+		 // (1+(l1-t)*ln(2)/1024)
+		 m=(int)((32L*(t-l)*(1477+l1-t)/1477+(l1-l)/2)/(l1-l));
 
+		 // MOD 32 is the next DCO with MOD 0
+		 if (m>31)
+		     {
+			 m=0;
+			 d++;
+		     }
 
+		 dist=(d>3)?(d-3):(3-d);
+		 if (dist<bestDist)
+		     {
+			 bestDco=d*32+m;
+			 bestBc1=XT2OFF+NCAL_MAP_RSEL0+(k>>3);
+			 bestDist=dist;
+		     }
+	     }
+	 l=l1;
+     }
 
+ if (!bestBc1) return 0;
 
+ dco_set(bestDco,bestBc1);
+ return 1;
+ }
 
 #endif // NewDCOCal
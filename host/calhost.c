@@ -0,0 +1,300 @@
+/*
+ calhost.c
+
+ Host controller for the DCO calibration in COMMAND_MODE
+
+ Drives one board on each serial port at the same time. Each board
+ gets the same command list and every line it sends is stored in
+ the CSV output with the port name in the first field:
+
+     port,F,i,hz,rsel,dco,mod,n,goal,ppm,sets,ms
+     port,V,i,n,goal,ppm
+     port,D,i,hz,dcoctl,bcsctl1
+     port,R,result,command    (ok, fail, error or timeout)
+
+ Build (POSIX):
+
+     cc -O2 -o calhost calhost.c
+
+ Usage:
+
+     calhost [-m mask] [-v] [-w] [-o file.csv] port [port ...]
+
+     -m mask   Frequencies to calibrate (bit i for entry i)
+     -v        Verify the stored data after the calibration
+     -w        Write the calibration to flash
+     -o file   Output CSV file (standard output by default)
+
+ Example for a tray of four boards, calibrating and writing all
+ frequencies and verifying them after the write:
+
+     calhost -w -v -o tray.csv /dev/ttyUSB0 /dev/ttyUSB1 \
+             /dev/ttyUSB2 /dev/ttyUSB3
+
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/************************ DEFINES ***********************************/
+
+#define MAX_BOARDS  64
+#define MAX_CMDS    8
+#define LINE_SIZE   128
+
+// Seconds allowed for each command
+#define CAL_TIMEOUT 300      // Calibration
+#define CMD_TIMEOUT 30       // Other commands
+
+/************************ BOARD DATA ********************************/
+
+typedef struct
+    {
+	const char *name;      // Port name
+	int fd;                // Port file (-1 when done)
+	int cmd;               // Current command
+	time_t deadline;       // End time of the current command
+	char line[LINE_SIZE];  // Received line
+	int pos;               // Next position in line
+	int ok;                // 1 if all commands ended with K
+    } Board;
+
+static Board Boards[MAX_BOARDS];
+static int nboards=0;
+
+// Command list for all boards
+static char Cmds[MAX_CMDS][24];
+static int ncmds=0;
+
+static FILE *out;
+
+/************************ FUNCTIONS *********************************/
+
+// Opens a port at 9600 baud 8N1 in raw mode
+// Returns the file or -1 on error
+static int portOpen(const char *name)
+ {
+ int fd;
+ struct termios t;
+
+ fd=open(name,O_RDWR|O_NOCTTY|O_NONBLOCK);
+ if (fd<0) return -1;
+
+ if (tcgetattr(fd,&t))
+     {
+	 close(fd);
+	 return -1;
+     }
+ cfmakeraw(&t);
+ cfsetispeed(&t,B9600);
+ cfsetospeed(&t,B9600);
+ t.c_cflag|=CLOCAL|CREAD;
+ t.c_cflag&=~(CSTOPB|PARENB|CRTSCTS);
+ if (tcsetattr(fd,TCSANOW,&t))
+     {
+	 close(fd);
+	 return -1;
+     }
+
+ return fd;
+ }
+
+// Sends the current command of a board
+static void cmdSend(Board *b)
+ {
+ char buf[32];
+ int n;
+
+ n=snprintf(buf,sizeof(buf),"%s\r",Cmds[b->cmd]);
+ if (write(b->fd,buf,n)!=n)
+	 fprintf(stderr,"%s: write error\n",b->name);
+ b->deadline=time(0)+((Cmds[b->cmd][0]=='C')?CAL_TIMEOUT:CMD_TIMEOUT);
+ }
+
+// Ends the work with a board
+static void boardEnd(Board *b,const char *result)
+ {
+ fprintf(out,"%s,R,%s,%s\n",b->name,result,Cmds[b->cmd]);
+ fflush(out);
+ close(b->fd);
+ b->fd=-1;
+ b->ok=(strcmp(result,"ok")==0);
+ }
+
+// Processes a line received from a board
+static void lineDo(Board *b)
+ {
+ switch (b->line[0])
+     {
+	 case 'K': // Command done
+		 b->cmd++;
+		 if (b->cmd>=ncmds)
+		     {
+			 b->cmd--;
+			 boardEnd(b,"ok");
+		     }
+		    else
+			 cmdSend(b);
+		 break;
+	 case '?': // Command not valid
+		 boardEnd(b,"fail");
+		 break;
+	 case 'E': // Error lock
+		 fprintf(out,"%s,%s\n",b->name,b->line);
+		 boardEnd(b,"error");
+		 break;
+	 case 0:
+		 break;
+	 default:  // Data line
+		 fprintf(out,"%s,%s\n",b->name,b->line);
+		 fflush(out);
+     }
+ }
+
+// Reads the characters received from a board
+static void boardRead(Board *b)
+ {
+ char buf[64];
+ int i,n;
+
+ n=read(b->fd,buf,sizeof(buf));
+ if (n<=0)
+     {
+	 if ((n<0)&&((errno==EAGAIN)||(errno==EINTR))) return;
+	 boardEnd(b,"fail");
+	 return;
+     }
+
+ for(i=0;(i<n)&&(b->fd>=0);i++)
+     {
+	 if ((buf[i]=='\r')||(buf[i]=='\n'))
+	     {
+		 b->line[b->pos]=0;
+		 b->pos=0;
+		 lineDo(b);
+		 continue;
+	     }
+	 if (b->pos<(LINE_SIZE-1)) b->line[b->pos++]=buf[i];
+     }
+ }
+
+static void usage(void)
+ {
+ fprintf(stderr,"Usage: calhost [-m mask] [-v] [-w] [-o file.csv] port [port ...]\n");
+ exit(2);
+ }
+
+int main(int argc,char **argv)
+ {
+ int i,n,opt,active,failed;
+ int verify=0,commit=0;
+ const char *mask=0,*file=0;
+ struct pollfd fds[MAX_BOARDS];
+ Board *map[MAX_BOARDS];
+ time_t now;
+
+ while ((opt=getopt(argc,argv,"m:vwo:"))!=-1)
+	 switch (opt)
+	     {
+		 case 'm': mask=optarg;    break;
+		 case 'v': verify=1;       break;
+		 case 'w': commit=1;       break;
+		 case 'o': file=optarg;    break;
+		 default:  usage();
+	     }
+ if ((optind>=argc)||((argc-optind)>MAX_BOARDS)) usage();
+
+ // Command list
+ if (mask) snprintf(Cmds[ncmds++],sizeof(Cmds[0]),"M,%lu",strtoul(mask,0,0));
+ strcpy(Cmds[ncmds++],"C");
+ if (commit) strcpy(Cmds[ncmds++],"W");
+ if (verify) strcpy(Cmds[ncmds++],"V");
+ strcpy(Cmds[ncmds++],"D");
+
+ out=stdout;
+ if (file)
+     {
+	 out=fopen(file,"w");
+	 if (!out)
+	     {
+		 perror(file);
+		 return 2;
+	     }
+     }
+
+ // Open all the ports
+ for(i=optind;i<argc;i++)
+     {
+	 Board *b=&Boards[nboards++];
+	 b->name=argv[i];
+	 b->cmd=0;
+	 b->fd=portOpen(argv[i]);
+	 if (b->fd<0)
+	     {
+		 fprintf(stderr,"%s: %s\n",argv[i],strerror(errno));
+		 fprintf(out,"%s,R,open,%s\n",b->name,Cmds[0]);
+		 continue;
+	     }
+	 // End any partial line and drop old data
+	 if (write(b->fd,"\r",1)!=1)
+		 fprintf(stderr,"%s: write error\n",b->name);
+     }
+ usleep(300000);
+ for(i=0;i<nboards;i++)
+	 if (Boards[i].fd>=0)
+	     {
+		 tcflush(Boards[i].fd,TCIFLUSH);
+		 cmdSend(&Boards[i]);
+	     }
+
+ // Serve all the boards until they end
+ while (1)
+     {
+	 n=0;
+	 now=time(0);
+	 for(i=0;i<nboards;i++)
+	     {
+		 Board *b=&Boards[i];
+		 if (b->fd<0) continue;
+		 if (now>b->deadline)
+		     {
+			 boardEnd(b,"timeout");
+			 continue;
+		     }
+		 fds[n].fd=b->fd;
+		 fds[n].events=POLLIN;
+		 map[n++]=b;
+	     }
+	 if (!n) break;
+
+	 if (poll(fds,n,1000)<0)
+	     {
+		 if (errno==EINTR) continue;
+		 perror("poll");
+		 break;
+	     }
+
+	 for(i=0;i<n;i++)
+		 if (fds[i].revents&(POLLIN|POLLERR|POLLHUP))
+			 boardRead(map[i]);
+     }
+
+ // Summary
+ active=failed=0;
+ for(i=0;i<nboards;i++)
+     {
+	 active++;
+	 if (!Boards[i].ok) failed++;
+     }
+ fprintf(stderr,"%d boards, %d ok, %d failed\n",active,active-failed,failed);
+ if (out!=stdout) fclose(out);
+
+ return failed?1:0;
+ }
@@ -0,0 +1,81 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Regression benchmark of the search strategies with the DCO simulator
+# Builds dcosim for each strategy, runs the same virtual parts and
+# prints measurements, simulated time and error for each one
+#
+# Usage: ./bench.sh [-c] [-u] [parts]
+#
+#   -c  Compare with baseline.txt, exit 1 if a strategy needs over 5%
+#       more measurements or time, its maximum error is over 10% higher
+#       or it locks more parts
+#   -u  Write the results as the new baseline.txt
+#
+# Run from this directory
+
+PARTS=1000
+CHECK=0
+UPDATE=0
+for a in "$@"
+do
+    case "$a" in
+        -c) CHECK=1 ;;
+        -u) UPDATE=1 ;;
+        *)  PARTS="$a" ;;
+    esac
+done
+
+CC=${CC:-cc}
+BIN=${TMPDIR:-/tmp}/dcosim.$$
+OUT=${TMPDIR:-/tmp}/dcosim.$$.txt
+trap 'rm -f "$BIN" "$OUT"' EXIT
+
+# Strategy name and main.c defines
+STRATEGIES='
+linear          |
+binary          |-DBINARY_SEARCH
+binary_warm     |-DBINARY_SEARCH -DWARM_START
+binary_cache    |-DBINARY_SEARCH -DMEASURE_CACHE
+factory_seed    |-DFACTORY_SEED
+binary_decision |-DBINARY_SEARCH -DDECISION_MODE
+binary_adaptive |-DBINARY_SEARCH -DADAPTIVE_NCAP
+binary_sweep    |-DBINARY_SEARCH -DCHAR_SWEEP
+binary_settle   |-DBINARY_SEARCH -DSETTLE_DETECT
+binary_ring     |-DBINARY_SEARCH -DRING_FILTER
+binary_aclk     |-DBINARY_SEARCH -DACLK_CAPTURE
+'
+
+: > "$OUT"
+printf "%-16s %8s %8s %9s %8s %6s\n" strategy meas time err_mean err_max locked
+echo "$STRATEGIES" | while IFS='|' read -r name defs
+do
+    name=$(echo $name)
+    [ -z "$name" ] && continue
+    if ! $CC -O2 -w -I. $defs -o "$BIN" dcosim.c -lm
+    then
+        echo "$name: build failed" >&2
+        echo "$name build failed" >> "$OUT"
+        continue
+    fi
+    "$BIN" -q -n "$PARTS" | awk -v n="$name" '/^RESULT/ {
+        printf "%-16s %8s %8s %9s %8s %6s\n", n, $3, $5, $7, $9, $11 }' | tee -a "$OUT"
+done
+
+if [ $UPDATE = 1 ]
+then
+    { echo "# parts $PARTS"; cat "$OUT"; } > baseline.txt
+    echo "baseline.txt updated"
+fi
+
+if [ $CHECK = 1 ]
+then
+    awk 'NR==FNR { if ($1!="#") { m[$1]=$2; t[$1]=$3; e[$1]=$5; l[$1]=$6 } ; next }
+         $2=="build" { print $1 ": build failed"; bad=1; next }
+         !($1 in m) { next }
+         ($2>m[$1]*1.05)||($3>t[$1]*1.05)||($5>e[$1]*1.10)||($6>l[$1]) {
+             print $1 ": regression (baseline " m[$1] " " t[$1] " " e[$1] " " l[$1] ")"; bad=1 }
+         END { exit bad }' baseline.txt "$OUT" || exit 1
+    echo "No regressions"
+fi
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# check.sh
+#
+# Checks of the flash and loop code with the DCO simulator
+# Builds dcosim for each check and runs it on the same virtual parts
+#
+# Usage: ./check.sh [parts]
+#
+# Exits 1 if a check fails on any part
+# Run from this directory
+
+PARTS=${1:-100}
+
+CC=${CC:-cc}
+BIN=${TMPDIR:-/tmp}/dcosim.$$
+trap 'rm -f "$BIN"' EXIT
+
+# Name, check and main.c defines
+CHECKS='
+records         |records  |-DAPPEND_RECORDS
+records_block   |records  |-DAPPEND_RECORDS -DFLASH_BLOCK
+header          |header   |
+header_block    |header   |-DFLASH_BLOCK
+header_bins     |header   |-DTEMP_BINS
+drift           |drift    |-DDRIFT_CORRECT
+drift_sleep     |drift    |-DDRIFT_CORRECT -DLOOP_SLEEP
+drift_aclk      |drift    |-DDRIFT_CORRECT -DLOOP_SLEEP -DACLK_CAPTURE
+counter         |counter  |-DFREQ_COUNTER -DTELEMETRY
+map             |map      |-DMAP_BUILD
+'
+
+BAD=0
+echo "$CHECKS" | {
+while IFS='|' read -r name check defs
+do
+    name=$(echo $name)
+    check=$(echo $check)
+    [ -z "$name" ] && continue
+    if ! $CC -O2 -w -I. $defs -o "$BIN" dcosim.c -lm
+    then
+        echo "$name: build failed" >&2
+        BAD=1
+        continue
+    fi
+    printf "%-16s " "$name"
+    "$BIN" -c "$check" -n "$PARTS" || BAD=1
+done
+exit $BAD
+} || exit 1
+echo "All checks passed"
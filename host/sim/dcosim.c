@@ -0,0 +1,1024 @@
+/*
+ dcosim.c
+
+ Offline DCO simulator and benchmark for the search algorithms
+
+ main.c is compiled for the host against a simulated DCO so the
+ search strategies can be compared without flashing real parts.
+ The options of main.c are given with -D as for the target build.
+
+ The firmware is built in LOW_POWER_WAIT mode, so each time it waits
+ for a capture the simulator advances one gate: it computes the
+ Timer A counts of the simulated DCO, adds them to TACCR0 and calls
+ the capture ISR, or the watchdog ISR that reads the capture in
+ ACLK_CAPTURE mode. The simulation is deterministic for a given seed.
+
+ Each virtual part has its own DCO model:
+
+   - A frequency for each RSEL and DCO pair, from random end points
+     and random steps around the typical S_RSEL and S_DCO ratios
+   - MOD mixes the DCO and DCO+1 periods as the modulator does
+   - Gaussian noise on each gate (NOISE_PPM)
+   - After each DCO change the first gate is a random mix of the old
+     and new frequencies and the rest of the change settles with
+     an exponential of SETTLE_GATES gates (SETTLE_FRAC of the step)
+   - Factory 1, 8, 12 and 16MHz data in Segment A with a random
+     error of FACTORY_PPM (only used in FACTORY_SEED mode)
+   - An exact signal at TA0CLK, that Timer A counts with TASSEL_0
+     (FREQ_COUNTER mode)
+
+ Each part is calibrated in a child process so all firmware data
+ starts from zero. The harness reports the measurements (setDCO
+ calls that measure the DCO), the simulated wall time including the
+ led blink pauses, and the final error of the stored DCOCTL/BCSCTL1
+ against the exact frequency of NCAL_FREQ_LIST.
+
+ Build and run from this directory:
+
+     cc -O2 -I. [-DBINARY_SEARCH ...] -o dcosim dcosim.c -lm
+     ./dcosim [-n parts] [-s seed] [-v] [-q]
+
+     -n parts  Number of virtual parts (default 1000)
+     -s seed   First part seed (default 1)
+     -v        One line for each part
+     -q        Only the RESULT line
+
+ With -DFACTORY_SEED -DINSTRUMENT it also reports the seed searches
+ of each part and how many found the goal without the normal search.
+
+ bench.sh builds and runs each strategy and checks them against
+ baseline.txt.
+
+ The flash, loop and counter code is checked with -c, that runs a
+ check for each part instead of the benchmark:
+
+     ./dcosim -c check [-n parts] [-s seed] [-v]
+
+     records   20 records in a row and a power loss at each word
+               of a record (APPEND_RECORDS)
+     header    Header and erase decision of the Segment B data when
+               blank, written, without header and with a changed byte
+     drift     Drift correction of each frequency after a +1% and a
+               -1% drift of the DCO (DRIFT_CORRECT)
+     counter   countHz of 10 signals from 60kHz to 26MHz against the
+               exact frequency (FREQ_COUNTER)
+     map       ncal_map_set of 50 frequencies from 0.2 to 20MHz with
+               the map of mapBuild (MAP_BUILD)
+
+ In check mode the info memory is blank and its writes go through a
+ model of the flash controller: a word write can only clear bits, an
+ erase sets the 64 byte segment to 0xFF and writes with LOCK set or
+ without WRT or ERASE are ignored. Each erase or programmed word is
+ one flash operation. A power loss stops the firmware at a given
+ operation and the part is then restarted as after a reset, with
+ only the flash data kept. The model single steps the stores with
+ the trap flag, so the checks need Linux on x86-64. check.sh builds
+ and runs all the checks.
+
+ FACTORY_SEED builds and the checks read the info memory at its real
+ address, so it is mapped at 0x1000. This needs vm.mmap_min_addr 4096
+ or less.
+ */
+
+// REG_EFL of the flash model
+#define _GNU_SOURCE
+
+#ifdef LONG_GATE
+#error "LONG_GATE is not simulated"
+#endif
+
+// Each wait for a capture is simulated as one gate
+#ifndef LOW_POWER_WAIT
+#define LOW_POWER_WAIT
+#endif
+
+#define main fw_main
+#include "../../main.c"
+#undef main
+
+#include <math.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+/*********************** MODEL DEFINES ******************************/
+
+#define NOISE_PPM     200      // Gate noise (standard deviation)
+#define SETTLE_FRAC   0.002    // Part of a change that settles slowly
+#define SETTLE_GATES  1.5      // Slow settling time constant in gates
+#define FACTORY_PPM   3000     // Factory data error (uniform)
+#define TIME_LIMIT    600.0    // Simulated seconds before a part is locked
+
+/*********************** REGISTERS **********************************/
+
+#define D8(n)  volatile unsigned char n;
+#define D16(n) volatile unsigned int n;
+D8(DCOCTL) D8(BCSCTL1) D8(BCSCTL2) D8(BCSCTL3)
+D8(P1DIR) D8(P1OUT) D8(P1IN) D8(P1SEL) D8(P1SEL2) D8(P1REN) D8(P1IE) D8(P1IES) D8(P1IFG)
+D8(P2DIR) D8(P2OUT) D8(P2IN) D8(P2SEL) D8(P2SEL2) D8(P2REN)
+D8(IE1) D8(IFG1) D8(IE2) D8(IFG2)
+D16(WDTCTL) D16(TACTL) D16(TACCTL0) D16(TACCTL1) D16(TACCTL2) D16(TACCR0) D16(TACCR1)
+D16(TACCR2) D16(TAR) D16(TA0IV)
+D16(TA1CTL) D16(TA1CCTL0) D16(TA1CCTL1) D16(TA1CCTL2) D16(TA1CCR0) D16(TA1CCR1)
+D16(TA1CCR2) D16(TA1R) D16(TA1IV)
+D16(FCTL1) D16(FCTL2) D16(FCTL3)
+D8(UCA0CTL0) D8(UCA0CTL1) D8(UCA0BR0) D8(UCA0BR1) D8(UCA0MCTL) D8(UCA0STAT)
+D8(UCA0RXBUF) D8(UCA0TXBUF)
+D16(ADC10CTL0) D16(ADC10CTL1) D16(ADC10MEM) D8(ADC10AE0)
+D8(CALDCO_1MHZ) D8(CALBC1_1MHZ) D8(CALDCO_8MHZ) D8(CALBC1_8MHZ)
+D8(CALDCO_12MHZ) D8(CALBC1_12MHZ) D8(CALDCO_16MHZ) D8(CALBC1_16MHZ)
+
+/*********************** SIMULATION DATA ****************************/
+
+// Exact frequencies in Hz
+#define SIM_HZ_(k,name,pos) (k)*1000.0,
+static const double SimHz[NFREQ]={NCAL_FREQ_LIST(SIM_HZ_)};
+
+// DCO model of the current part
+static double F[16][8];          // Frequency of each RSEL and DCO
+
+// Simulation state
+static unsigned long long Rng;   // Random generator state
+static double fOld,fDev;         // Frequency before the change and slow deviation
+static double cntFrac;           // Fraction of count not yet in TACCR0
+static int lastKey=-1;           // Last BCSCTL1 RSEL and DCOCTL
+static int lastNcap=0;           // ncap after the last gate
+static double simTime=0;         // Simulated seconds
+static long nmeas=0;             // Measurements
+static double extHz=0;           // Signal at TA0CLK
+
+// Flash model state
+static unsigned char flashOld[256];       // Info memory before the store
+static volatile unsigned long flashAddr;  // Address of the store
+static volatile long flashOps=0;          // Erases and programmed words
+static volatile long flashErases=0;       // Segment erases
+static volatile long flashOver=0;         // Words programmed over cleared bits
+static volatile long flashIgnored=0;      // Writes ignored by the controller
+static volatile long flashCut=0;          // Operation of the power loss (0 none)
+static sigjmp_buf powerLoss;
+
+// Result of a part
+typedef struct
+    {
+	int status;                  // 0 Ok, 1 Locked
+	long meas;                   // Measurements
+	double time;                 // Simulated seconds
+	double err[NFREQ];           // Final error in ppm
+	long seeds;                  // Seed searches (FACTORY_SEED and INSTRUMENT)
+	long seedHits;               // Seed searches that found the goal
+    } Result;
+
+/*********************** MODEL **************************************/
+
+// Uniform random number in [0,1)
+static double rnd(void)
+ {
+ Rng=Rng*6364136223846793005ULL+1442695040888963407ULL;
+ return (Rng>>11)*(1.0/9007199254740992.0);
+ }
+
+// Gaussian random number
+static double gauss(void)
+ {
+ double u=rnd()+1e-12,v=rnd();
+ return sqrt(-2*log(u))*cos(2*M_PI*v);
+ }
+
+// Frequency of a DCO configuration
+static double dcoFreq(int bc1,int dcoctl)
+ {
+ int r=bc1&0x0F,d=dcoctl>>5,m=dcoctl&0x1F;
+
+ if (d==7) return F[r][7];
+ return 32.0/((32-m)/F[r][d]+m/F[r][d+1]);
+ }
+
+// Configuration nearest to a frequency
+static void nearest(double f,unsigned char *dcoctl,unsigned char *bc1)
+ {
+ int r,x;
+ double e,best=1e30;
+
+ for(r=0;r<16;r++)
+	 for(x=0;x<256;x++)
+	     {
+		 e=fabs(dcoFreq(r,x)-f);
+		 if (e<best)
+		     {
+			 best=e;
+			 *dcoctl=x;
+			 *bc1=XT2OFF+r;
+		     }
+	     }
+ }
+
+// New virtual part
+// fDCO(0,3) from 0.07 to 0.17MHz and fDCO(15,3) from 15.5 to 21MHz
+static void partNew(unsigned long seed)
+ {
+ int r,d;
+ double f03,f153,sr,sd;
+
+ Rng=seed*2654435761ULL+1;
+ f03=0.07e6+0.10e6*rnd();
+ f153=15.5e6+5.5e6*rnd();
+ sr=pow(f153/f03,1.0/15);
+
+ for(r=0;r<16;r++)
+     {
+	 sd=1.065+0.02*rnd();
+	 F[r][3]=f03*pow(sr,r)*(r&&(r<15)?(0.98+0.04*rnd()):1.0);
+	 for(d=4;d<8;d++) F[r][d]=F[r][d-1]*sd*(0.995+0.01*rnd());
+	 for(d=2;d>=0;d--) F[r][d]=F[r][d+1]/(sd*(0.995+0.01*rnd()));
+     }
+ }
+
+// Factory data of a frequency in kHz with its error
+static void factory(double khz,int pos)
+ {
+ unsigned char dcoctl=0xFF,bc1=0xFF;
+
+ nearest(khz*1000*(1+FACTORY_PPM*1e-6*(2*rnd()-1)),&dcoctl,&bc1);
+ if (pos)
+     {
+	 ((unsigned char *)(unsigned long)pos)[0]=dcoctl;
+	 ((unsigned char *)(unsigned long)pos)[1]=bc1;
+     }
+ if (khz==1000)
+     {
+	 CALDCO_1MHZ=dcoctl;
+	 CALBC1_1MHZ=bc1;
+     }
+ }
+
+// Segment A factory data (info memory must be mapped)
+static void segA(int mapped)
+ {
+ factory(1000,mapped?CALDCO_1MHZ_:0);
+ if (!mapped) return;
+ factory(8000,CALDCO_8MHZ_);
+ factory(12000,CALDCO_12MHZ_);
+ factory(16000,CALDCO_16MHZ_);
+ }
+
+/*********************** HARDWARE ***********************************/
+
+// ACLK cycles of each gate
+static int isrCycles(void)
+ {
+ return GATE_CYCLES;
+ }
+
+// Runs the hardware until the ISR that ends the next gate
+static void simGate(void)
+ {
+ int key;
+ double f,u,dt,c;
+
+ dt=isrCycles()/32768.0;
+ key=(BCSCTL1&0x0F)*256+DCOCTL;
+ f=dcoFreq(BCSCTL1,DCOCTL);
+
+ // A change is done at a random time of the gate
+ u=0;
+ if (key!=lastKey)
+     {
+	 if (lastKey>=0)
+	     {
+		 u=rnd();
+		 fDev=(fOld-f)*SETTLE_FRAC;
+	     }
+	 lastKey=key;
+     }
+
+ c=(u*fOld+(1-u)*(f+fDev))*dt*(1+NOISE_PPM*1e-6*gauss());
+ fDev*=exp(-1.0/SETTLE_GATES);
+ fOld=f;
+
+ // Timer A counts the TA0CLK signal
+ if (!(TACTL&TASSEL_3)) c=extHz*dt;
+
+ // Timer A counts
+ cntFrac+=c;
+ TACCR0+=(unsigned int)cntFrac;
+ cntFrac-=(unsigned int)cntFrac;
+ simTime+=dt;
+
+ // A new measurement restarts the capture count
+ if (ncap<lastNcap) nmeas++;
+ #ifdef ACLK_CAPTURE
+ WDT_ISR();
+ #else
+ CAPTURE0_ISR();
+ #endif
+ lastNcap=ncap;
+
+ // The part is locked in errorLock()
+ if (simTime>TIME_LIMIT) exit(1);
+ }
+
+// Sleep until an interrupt
+void __bis_SR_register(unsigned int bits)
+ {
+ (void)bits;
+ simGate();
+ }
+
+void __bic_SR_register(unsigned int bits)
+ {
+ (void)bits;
+ }
+
+void __bic_SR_register_on_exit(unsigned int bits)
+ {
+ (void)bits;
+ }
+
+// Delays are timed at the current DCO frequency
+void __delay_cycles(unsigned long n)
+ {
+ simTime+=n/dcoFreq(BCSCTL1,DCOCTL);
+ if (simTime>TIME_LIMIT) exit(1);
+ }
+
+/*********************** FLASH **************************************/
+
+#define INFO ((unsigned char *) 0x1000)
+
+// A store to the read only info memory faults, then the page is
+// opened and the store is single stepped
+// The model state changes in the handlers so it is volatile
+static void flashFault(int sig,siginfo_t *si,void *ctx)
+ {
+ ucontext_t *uc=ctx;
+
+ (void)sig;
+ flashAddr=(unsigned long)si->si_addr;
+ if ((flashAddr<0x1000)||(flashAddr>=0x1100))
+     {
+	 // Not a flash write, fault again as usual
+	 signal(SIGSEGV,SIG_DFL);
+	 return;
+     }
+
+ memcpy(flashOld,INFO,256);
+ mprotect(INFO,0x1000,PROT_READ|PROT_WRITE);
+ uc->uc_mcontext.gregs[REG_EFL]|=0x100;     // Trap flag
+ }
+
+// After the store the controller rules are applied to each word
+// that changed, in address order
+static void flashStep(int sig,siginfo_t *si,void *ctx)
+ {
+ ucontext_t *uc=ctx;
+ unsigned short now[128],*w=(unsigned short *) INFO,*o=(unsigned short *) flashOld;
+ int i,cut=0;
+
+ (void)sig;
+ (void)si;
+ uc->uc_mcontext.gregs[REG_EFL]&=~0x100;
+
+ memcpy(now,INFO,256);
+ memcpy(INFO,flashOld,256);
+
+ if ((FCTL3&LOCK)||(!(FCTL1&(ERASE+WRT))))
+	 flashIgnored++;
+ else if (FCTL1&ERASE)
+     {
+	 // The dummy write erases its segment
+	 memset(INFO+((flashAddr-0x1000)&~63UL),0xFF,64);
+	 flashErases++;
+	 flashOps++;
+	 cut=(flashCut&&(flashOps>=flashCut));
+     }
+ else
+	 for(i=0;(i<128)&&(!cut);i++)
+	     {
+		 if (now[i]==o[i]) continue;
+		 if ((o[i]&now[i])!=now[i]) flashOver++;
+		 w[i]=o[i]&now[i];
+		 flashOps++;
+		 cut=(flashCut&&(flashOps>=flashCut));
+	     }
+
+ // Word and block writes are always done
+ FCTL3|=WAIT;
+
+ mprotect(INFO,0x1000,PROT_READ);
+ if (cut) siglongjmp(powerLoss,1);
+ }
+
+// Maps the blank info memory at 0x1000
+// Returns 0 if it cannot be mapped
+static int infoMap(void)
+ {
+ if (mmap(INFO,0x1000,PROT_READ|PROT_WRITE,
+		  MAP_FIXED|MAP_PRIVATE|MAP_ANONYMOUS,-1,0)==MAP_FAILED)
+	 return 0;
+ memset(INFO,0xFF,0x1000);
+ return 1;
+ }
+
+// Starts the flash model, the flash is locked as after a reset
+static void flashOn(void)
+ {
+ struct sigaction sa;
+
+ memset(&sa,0,sizeof(sa));
+ sa.sa_flags=SA_SIGINFO;
+ sa.sa_sigaction=flashFault;
+ sigaction(SIGSEGV,&sa,0);
+ sa.sa_sigaction=flashStep;
+ sigaction(SIGTRAP,&sa,0);
+
+ FCTL1=FWKEY;
+ FCTL3=FWKEY+LOCK;
+ mprotect(INFO,0x1000,PROT_READ);
+ }
+
+// Changes a flash byte outside the controller
+static void flashPoke(unsigned long addr,unsigned char v)
+ {
+ mprotect(INFO,0x1000,PROT_READ|PROT_WRITE);
+ *((unsigned char *) addr)=v;
+ mprotect(INFO,0x1000,PROT_READ);
+ }
+
+/*********************** HARNESS ************************************/
+
+// Calibrates one part in a child process
+static int partRun(unsigned long seed,int mapped,Result *res)
+ {
+ int fd[2],i,st;
+ pid_t pid;
+
+ memset(res,0,sizeof(Result));
+ if (pipe(fd)) return -1;
+
+ pid=fork();
+ if (pid<0) return -1;
+ if (!pid)
+     {
+	 close(fd[0]);
+	 partNew(seed);
+	 segA(mapped);
+
+	 configureAll();
+	 eint();
+	 calibrate();
+
+	 res->meas=nmeas;
+	 res->time=simTime;
+     #if defined(FACTORY_SEED) && defined(INSTRUMENT)
+	 res->seeds=Inst.seeds;
+	 res->seedHits=Inst.seedHits;
+     #endif
+	 for(i=0;i<NFREQ;i++)
+		 res->err[i]=1e6*(dcoFreq(CalBC1[i],CalDCO[i])-SimHz[i])/SimHz[i];
+	 if (write(fd[1],res,sizeof(Result))!=sizeof(Result)) _exit(2);
+	 _exit(0);
+     }
+
+ close(fd[1]);
+ if (read(fd[0],res,sizeof(Result))!=sizeof(Result)) res->status=1;
+ close(fd[0]);
+ waitpid(pid,&st,0);
+ if ((!WIFEXITED(st))||WEXITSTATUS(st)) res->status=1;
+
+ return 0;
+ }
+
+/*********************** CHECKS *************************************/
+
+// Result of a check on a part
+typedef struct
+    {
+	int status;                  // 0 Ok, 1 Failed
+	long n;                      // Checked values
+	double sum;                  // Sum of the absolute errors
+	double max;                  // Maximum absolute error
+    } Check;
+
+// Check function, returns 0 if Ok
+typedef int (*CheckFn)(Check *);
+
+static unsigned long chkSeed;     // Part of the check
+static const char *chkName;       // Name of the check
+
+// Fails the check if cond is false
+#define CHECK(cond,what)                                            \
+    do { if (!(cond)) {                                             \
+        printf("part %lu %s: %s\n",chkSeed,chkName,(what));          \
+        return 1; } } while (0)
+
+// Adds an error to the result
+static void checkValue(Check *c,double e)
+ {
+ e=fabs(e);
+ c->n++;
+ c->sum+=e;
+ if (e>c->max) c->max=e;
+ }
+
+// Restarts the firmware as after a reset or a power loss
+// Only the flash data is kept
+static void reboot(void)
+ {
+ FCTL1=FWKEY;
+ FCTL3=FWKEY+LOCK;
+ FreqMask=FREQ_MASK;
+ #ifdef FLASH_OVERRIDE
+ flashErase=1;
+ #else
+ flashErase=0;
+ #endif
+ #ifdef APPEND_RECORDS
+ recFind();
+ #elif defined(TEMP_BINS)
+ calValid=ncal_valid_bin(tempBin);
+ #else
+ calValid=ncal_valid();
+ #endif
+ }
+
+// Writes the calibration with a power loss at flash operation n
+// of the write
+// Returns 1 if the power was lost
+static int cutWrite(long n)
+ {
+ flashCut=flashOps+n;
+ if (sigsetjmp(powerLoss,1))
+     {
+	 flashCut=0;
+	 return 1;
+     }
+ flashWrite();
+ flashCut=0;
+ return 0;
+ }
+
+#ifdef APPEND_RECORDS
+
+// Test if the newest record is record n
+// Record n has its own counter and frequency 0 DCOCTL
+static int recIs(int n)
+ {
+ return Record&&(Record[3]==n)
+		&&(Record[NCAL_REC_DATA]==(unsigned char)n+(CalBC1[0]<<8));
+ }
+
+// Calibration records
+// 20 records are written in a row, the ring wraps and the first
+// erase is done when a record starts a used segment
+// Then the power is lost at each word of a record: the newest
+// record must still be the old one, and the next record must not
+// use the slot partially written
+static int checkRecords(Check *c)
+ {
+ int n,cut,k,blank;
+
+ calibrate();
+ reboot();
+ CHECK(!Record,"record found in blank flash");
+
+ for(n=0;n<20;n++)
+     {
+	 CalDCO[0]=n;
+	 flashWrite();
+	 reboot();
+	 CHECK(recIs(n),"newest record after a write");
+	 if (n<NCAL_REC_SLOTS) CHECK(!flashErases,"erase before the ring wraps");
+	 c->n++;
+     }
+ CHECK(flashErases,"no erase after the ring wraps");
+
+ for(cut=1;cut<NCAL_REC_WORDS;cut++,n++)
+     {
+	 // Partial record with other data
+	 k=recFree();
+	 CalDCO[0]=n^0x80;
+	 CHECK(cutWrite(cut),"no power loss");
+	 reboot();
+	 CHECK(recIs(n-1),"newest record after a power loss");
+
+	 // The slot is blank if the power was lost after its erase
+	 blank=recBlank(k);
+	 CalDCO[0]=n;
+	 flashWrite();
+	 reboot();
+	 CHECK(recIs(n),"newest record after a power loss and a write");
+	 CHECK(blank||(recPos!=k),"partially written slot used");
+	 c->n++;
+     }
+
+ CHECK(!flashOver,"word programmed over cleared bits");
+ CHECK(!flashIgnored,"flash write ignored");
+ return 0;
+ }
+
+#else
+
+// Test if the stored data is valid and is the RAM calibration
+static int calStored(void)
+ {
+ int i;
+
+ if (!calValid) return 0;
+ for(i=0;i<NFREQ;i++)
+	 if ((calPtr(i)[0]!=CalDCO[i])||(calPtr(i)[1]!=CalBC1[i])) return 0;
+
+ return 1;
+ }
+
+// Header of the fixed positions data
+// Each case gives calValid, the erase decision of testFlashEmpty
+// and the data after the next write
+static int checkHeader(Check *c)
+ {
+ long e;
+
+ calibrate();
+
+ // Blank
+ reboot();
+ CHECK(!calValid,"blank: valid header");
+ CHECK((!testFlashEmpty())&&(!flashErase),"blank: erase decision");
+ flashWrite();
+ reboot();
+ CHECK(calStored(),"blank: data after the write");
+ CHECK(!flashErases,"blank: segment erased");
+ c->n++;
+
+ // Written, the header cannot be written again so it is erased
+ CalDCO[0]^=1;
+ e=flashErases;
+ CHECK(testFlashEmpty()&&flashErase,"written: erase decision");
+ flashWrite();
+ reboot();
+ CHECK(calStored(),"written: data after the write");
+ CHECK(flashErases==e+1,"written: segment not erased");
+ c->n++;
+
+ // Without header, the power is lost after the erase and the data
+ CalDCO[0]^=1;
+ testFlashEmpty();
+ CHECK(cutWrite(1+NFREQ),"no header: no power loss");
+ reboot();
+ CHECK(!calValid,"no header: valid header");
+ e=flashErases;
+ CHECK((!testFlashEmpty())&&flashErase,"no header: erase decision");
+ flashWrite();
+ reboot();
+ CHECK(calStored(),"no header: data after the write");
+ CHECK(flashErases==e+1,"no header: segment not erased");
+ c->n++;
+
+ // A changed data byte
+ flashPoke(CalPos[NFREQ/2]-BIN_OFS,CalDCO[NFREQ/2]^0x10);
+ reboot();
+ CHECK(!calValid,"changed byte: valid header");
+ e=flashErases;
+ CHECK((!testFlashEmpty())&&flashErase,"changed byte: erase decision");
+ flashWrite();
+ reboot();
+ CHECK(calStored(),"changed byte: data after the write");
+ CHECK(flashErases==e+1,"changed byte: segment not erased");
+ c->n++;
+
+ CHECK(!flashOver,"word programmed over cleared bits");
+ CHECK(!flashIgnored,"flash write ignored");
+ return 0;
+ }
+
+#endif // APPEND_RECORDS
+
+#ifdef DRIFT_CORRECT
+
+// Drift correction
+// All the DCO frequencies change by 1%, then driftCorrect must
+// bring each frequency inside its threshold without moving back
+// The error is the final one in ppm against the goal count, as
+// GoalN is rounded the exact frequency can be 0.05% away
+static int checkDrift(Check *c)
+ {
+ int i,k,r,d,s,moves;
+ unsigned char last;
+ double e,lim,goal;
+
+ calibrate();
+
+ // Margin and the noise of DRIFT_NCAP captures
+ lim=1e6/(1<<DRIFT_SHIFT)+4*NOISE_PPM/sqrt(DRIFT_NCAP);
+
+ for(s=-1;s<=1;s+=2)
+	 for(i=0;i<NFREQ;i++)
+	     {
+		 for(r=0;r<16;r++)
+			 for(d=0;d<8;d++) F[r][d]*=1+s*0.01;
+
+		 dco_set(CalDCO[i],CalBC1[i]);
+		 moves=0;
+		 for(k=0;k<20;k++)
+		     {
+			 last=DCOCTL;
+             #ifdef LOOP_SLEEP
+			 // Gates are started from the slow interval as the loop does
+			 loopTiming(0);
+			 loopTiming(1);
+             #endif
+			 driftCorrect(i);
+			 if (DCOCTL==last) continue;
+			 moves++;
+			 CHECK(DCOCTL==(unsigned char)(last-s),"correction moved back");
+		     }
+
+		 goal=GoalN[i]*32768.0/GATE_CYCLES;
+		 e=1e6*(dcoFreq(BCSCTL1,DCOCTL)-goal)/goal;
+		 CHECK(moves,"no correction");
+		 CHECK(fabs(e)<=lim,"error after the correction");
+		 checkValue(c,e);
+
+		 for(r=0;r<16;r++)
+			 for(d=0;d<8;d++) F[r][d]/=1+s*0.01;
+	     }
+
+ return 0;
+ }
+
+#endif // DRIFT_CORRECT
+
+#ifdef FREQ_COUNTER
+
+// Frequency counter
+// 10 signals from 60kHz to 26MHz, evenly in log2, are counted
+// Each of the COUNT_NMEAS measurements can miss an edge and the
+// result is rounded down, so the error is under COUNT_NMEAS+1
+// counts in the measurement time
+// TA0CLK must never be an output
+// The error is in ppm
+static int checkCounter(Check *c)
+ {
+ int k;
+ unsigned long hz;
+ double e,lim;
+
+ lim=(COUNT_NMEAS+1)*32768.0/((double)GATE_CYCLES*NCAP*COUNT_NMEAS);
+
+ for(k=0;k<10;k++)
+     {
+	 extHz=60e3*pow(26e6/60e3,(k+rnd())/10);
+	 hz=countHz();
+	 e=hz-extHz;
+	 CHECK(fabs(e)<lim,"count error");
+	 CHECK(!(P1DIR&COUNT_PIN),"TA0CLK is an output");
+	 checkValue(c,1e6*e/extHz);
+     }
+
+ return 0;
+ }
+
+#endif // FREQ_COUNTER
+
+#ifdef MAP_BUILD
+
+// Dense DCO map
+// The map is measured and written, then 50 frequencies from 0.2 to
+// 20MHz, evenly in log2, are set with ncal_map_set
+// Every frequency must be found and its error is under one map
+// unit (0.27%) plus half a MOD step
+// The error is in ppm
+static int checkMap(Check *c)
+ {
+ int k;
+ double hz,e;
+
+ calibrate();
+ mapBuild();
+ CHECK(ncal_map_valid(),"map header");
+
+ for(k=0;k<50;k++)
+     {
+	 hz=0.2e6*pow(100,(k+rnd())/50);
+	 CHECK(ncal_map_set((unsigned long)hz),"frequency not found");
+	 e=1e6*(dcoFreq(BCSCTL1,DCOCTL)-hz)/hz;
+	 CHECK(fabs(e)<4000,"frequency error");
+	 checkValue(c,e);
+     }
+
+ CHECK(!flashOver,"word programmed over cleared bits");
+ CHECK(!flashIgnored,"flash write ignored");
+ return 0;
+ }
+
+#endif // MAP_BUILD
+
+// Checks of this build
+static const struct
+    {
+	const char *name;
+	CheckFn fn;
+    } Checks[]=
+    {
+    #ifdef APPEND_RECORDS
+	{"records",checkRecords},
+    #else
+	{"header",checkHeader},
+    #endif
+    #ifdef DRIFT_CORRECT
+	{"drift",checkDrift},
+    #endif
+    #ifdef FREQ_COUNTER
+	{"counter",checkCounter},
+    #endif
+    #ifdef MAP_BUILD
+	{"map",checkMap},
+    #endif
+	{0,0}
+    };
+
+// Runs a check on one part in a child process
+static int checkRun(unsigned long seed,CheckFn fn,Check *c)
+ {
+ int fd[2],st;
+ pid_t pid;
+
+ memset(c,0,sizeof(Check));
+ if (pipe(fd)) return -1;
+
+ fflush(stdout);
+ pid=fork();
+ if (pid<0) return -1;
+ if (!pid)
+     {
+	 close(fd[0]);
+	 chkSeed=seed;
+	 partNew(seed);
+	 segA(1);
+
+	 configureAll();
+	 eint();
+	 flashOn();
+	 c->status=fn(c);
+
+	 fflush(stdout);
+	 if (write(fd[1],c,sizeof(Check))!=sizeof(Check)) _exit(2);
+	 _exit(0);
+     }
+
+ close(fd[1]);
+ if (read(fd[0],c,sizeof(Check))!=sizeof(Check)) c->status=1;
+ close(fd[0]);
+ waitpid(pid,&st,0);
+ if ((!WIFEXITED(st))||WEXITSTATUS(st)) c->status=1;
+
+ return 0;
+ }
+
+// Runs a check on all the parts
+// Returns 0 if all the parts pass
+static int checkAll(const char *name,long parts,unsigned long seed,int verbose)
+ {
+ int i,p,fails=0;
+ long n=0;
+ double sum=0,max=0;
+ Check c;
+
+ for(i=0;Checks[i].name;i++)
+	 if (!strcmp(Checks[i].name,name)) break;
+ if (!Checks[i].name)
+     {
+	 fprintf(stderr,"dcosim: check %s is not in this build\n",name);
+	 return 2;
+     }
+ chkName=name;
+
+ if (!infoMap())
+     {
+	 perror("dcosim: info memory at 0x1000 (vm.mmap_min_addr)");
+	 return 2;
+     }
+
+ for(p=0;p<parts;p++)
+     {
+	 if (checkRun(seed+p,Checks[i].fn,&c))
+	     {
+		 perror("dcosim");
+		 return 2;
+	     }
+	 if (c.status)
+	     {
+		 fails++;
+		 if (verbose) printf("part %lu failed\n",seed+p);
+		 continue;
+	     }
+	 n+=c.n;
+	 sum+=c.sum;
+	 if (c.max>max) max=c.max;
+	 if (verbose)
+		 printf("part %lu values %ld err_mean %.0f err_max %.0f\n",
+				seed+p,c.n,c.n?c.sum/c.n:0,c.max);
+     }
+
+ printf("CHECK %s parts %ld values %ld err_mean %.0f err_max %.0f failed %d\n",
+		name,parts,n,n?sum/n:0,max,fails);
+
+ return fails?1:0;
+ }
+
+int main(int argc,char **argv)
+ {
+ int opt,i,p,verbose=0,quiet=0,mapped=0,fails=0;
+ long parts=1000,maxMeas=0;
+ unsigned long seed=1;
+ const char *check=0;
+ double sumMeas=0,sumTime=0,maxTime=0,sumErr=0,maxErr=0,e;
+ double sumSeeds=0,sumHits=0;
+ long nerr=0;
+ Result res;
+
+ while ((opt=getopt(argc,argv,"c:n:s:vq"))!=-1)
+	 switch (opt)
+	     {
+		 case 'c': check=optarg;                break;
+		 case 'n': parts=atol(optarg);          break;
+		 case 's': seed=strtoul(optarg,0,0);    break;
+		 case 'v': verbose=1;                   break;
+		 case 'q': quiet=1;                     break;
+		 default:
+			 fprintf(stderr,"Usage: dcosim [-c check] [-n parts] [-s seed] [-v] [-q]\n");
+			 return 2;
+	     }
+
+ if (check) return checkAll(check,parts,seed,verbose);
+
+ // Segment A at its real address
+ #ifdef FACTORY_SEED
+ if (!infoMap())
+     {
+	 perror("dcosim: info memory at 0x1000 (vm.mmap_min_addr)");
+	 return 2;
+     }
+ mapped=1;
+ #endif
+
+ for(p=0;p<parts;p++)
+     {
+	 if (partRun(seed+p,mapped,&res))
+	     {
+		 perror("dcosim");
+		 return 2;
+	     }
+	 if (res.status)
+	     {
+		 fails++;
+		 if (verbose) printf("part %lu locked\n",seed+p);
+		 continue;
+	     }
+
+	 sumMeas+=res.meas;
+	 sumSeeds+=res.seeds;
+	 sumHits+=res.seedHits;
+	 sumTime+=res.time;
+	 if (res.meas>maxMeas) maxMeas=res.meas;
+	 if (res.time>maxTime) maxTime=res.time;
+	 for(i=0;i<NFREQ;i++)
+	     {
+		 e=fabs(res.err[i]);
+		 sumErr+=e;
+		 nerr++;
+		 if (e>maxErr) maxErr=e;
+	     }
+
+	 if (verbose)
+	     {
+		 printf("part %lu meas %ld time %.3f err",seed+p,res.meas,res.time);
+		 for(i=0;i<NFREQ;i++) printf(" %.0f",res.err[i]);
+		 printf("\n");
+	     }
+     }
+
+ p=parts-fails;
+ if (!p) p=1;
+ if (!nerr) nerr=1;
+ if (!quiet)
+     {
+	 printf("parts %ld, first seed %lu\n",parts,seed);
+	 printf("measurements/part  mean %8.1f  max %8ld\n",sumMeas/p,maxMeas);
+	 printf("time/part (s)      mean %8.3f  max %8.3f\n",sumTime/p,maxTime);
+	 printf("error (ppm)        mean %8.0f  max %8.0f\n",sumErr/nerr,maxErr);
+     #if defined(FACTORY_SEED) && defined(INSTRUMENT)
+	 printf("seed searches/part mean %8.1f  hits %6.1f\n",sumSeeds/p,sumHits/p);
+     #endif
+	 printf("locked parts       %d\n",fails);
+     }
+ printf("RESULT meas %.1f time %.3f err_mean %.0f err_max %.0f locked %d\n",
+		sumMeas/p,sumTime/p,sumErr/nerr,maxErr,fails);
+
+ return 0;
+ }
@@ -0,0 +1,7 @@
+/*
+ iomacros.h
+
+ Host stub of the mspgcc register macros for the DCO simulator
+ */
+
+#define const_sfrb(x,x_) extern const volatile unsigned char x
@@ -0,0 +1,16 @@
+/*
+ legacymsp430.h
+
+ Host build for the DCO simulator
+ ISRs are plain functions called by the simulator and, as there is
+ only one thread, interrupts do not need to be disabled
+ */
+
+#ifndef LEGACY_SIM_H
+#define LEGACY_SIM_H
+
+#define interrupt(v) void
+#define eint() ((void)0)
+#define dint() ((void)0)
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ msp430.h
+
+ Host build of the MSP430G2553 registers for the DCO simulator
+ Registers are plain variables defined in dcosim.c and only the
+ names and bits used by main.c are given
+ */
+
+#ifndef MSP430_SIM_H
+#define MSP430_SIM_H
+#define __MSP430_HAS_BC2__
+#define __MSP430_HAS_FLASH2__
+#define __MSP430_HAS_TA2__
+#define __MSP430_HAS_ADC10__
+#define BIT0 0x01
+#define BIT1 0x02
+#define BIT2 0x04
+#define BIT3 0x08
+#define BIT4 0x10
+#define BIT5 0x20
+#define BIT6 0x40
+#define BIT7 0x80
+#define R8(n) extern volatile unsigned char n;
+#define R16(n) extern volatile unsigned int n;
+R8(DCOCTL) R8(BCSCTL1) R8(BCSCTL2) R8(BCSCTL3) R8(P1DIR) R8(P1OUT) R8(P1IN) R8(P1SEL) R8(P1SEL2) R8(P1REN) R8(P1IE) R8(P1IES) R8(P1IFG)
+R8(P2DIR) R8(P2OUT) R8(P2IN) R8(P2SEL) R8(P2SEL2) R8(P2REN)
+R8(IE1) R8(IFG1) R8(IE2) R8(IFG2)
+R16(WDTCTL) R16(TACTL) R16(TACCTL0) R16(TACCTL1) R16(TACCTL2) R16(TACCR0) R16(TACCR1) R16(TACCR2) R16(TAR) R16(TA0IV)
+R16(TA1CTL) R16(TA1CCTL0) R16(TA1CCTL1) R16(TA1CCTL2) R16(TA1CCR0) R16(TA1CCR1) R16(TA1CCR2) R16(TA1R) R16(TA1IV)
+R16(FCTL1) R16(FCTL2) R16(FCTL3)
+R8(UCA0CTL0) R8(UCA0CTL1) R8(UCA0BR0) R8(UCA0BR1) R8(UCA0MCTL) R8(UCA0STAT) R8(UCA0RXBUF) R8(UCA0TXBUF)
+R16(ADC10CTL0) R16(ADC10CTL1) R16(ADC10MEM) R8(ADC10AE0)
+R8(CALDCO_1MHZ) R8(CALBC1_1MHZ) R8(CALDCO_8MHZ) R8(CALBC1_8MHZ) R8(CALDCO_12MHZ) R8(CALBC1_12MHZ) R8(CALDCO_16MHZ) R8(CALBC1_16MHZ)
+#define TA0CTL TACTL
+#define TA0CCTL0 TACCTL0
+#define TA0CCR0 TACCR0
+#define TA0R TAR
+#define CALDCO_1MHZ_ 0x10FE
+#define CALBC1_1MHZ_ 0x10FF
+#define CALDCO_8MHZ_ 0x10FC
+#define CALBC1_8MHZ_ 0x10FD
+#define CALDCO_12MHZ_ 0x10FA
+#define CALBC1_12MHZ_ 0x10FB
+#define CALDCO_16MHZ_ 0x10F8
+#define CALBC1_16MHZ_ 0x10F9
+#define TAG_DCO_30 0x01
+#define MOD0 0x01
+#define DCO0 0x20
+#define DCO1 0x40
+#define DCO2 0x80
+#define RSEL0 0x01
+#define RSEL1 0x02
+#define RSEL2 0x04
+#define RSEL3 0x08
+#define DIVA0 0x10
+#define DIVA1 0x20
+#define DIVA_0 0x00
+#define DIVA_1 0x10
+#define DIVA_2 0x20
+#define DIVA_3 0x30
+#define XTS 0x40
+#define XT2OFF 0x80
+#define DIVS0 0x02
+#define DIVM0 0x10
+#define DIVM_1 0x10
+#define SELM0 0x40
+#define DIVS_0 0
+#define DIVS_3 0x06
+#define SELS 0x08
+#define XCAP0 0x04
+#define XCAP1 0x08
+#define XCAP_3 0x0C
+#define LFXT1S0 0x10
+#define LFXT1S1 0x20
+#define XT2S0 0x40
+#define LFXT1OF 0x01
+#define OFIFG 0x02
+#define WDTIE 0x01
+#define WDTIFG 0x01
+#define WDTPW 0x5A00
+#define WDTHOLD 0x80
+#define WDTTMSEL 0x10
+#define WDTCNTCL 0x08
+#define WDTSSEL 0x04
+#define WDTIS0 0x01
+#define WDTIS1 0x02
+#define WDT_ADLY_1000 (WDTPW+WDTTMSEL+WDTCNTCL+WDTSSEL)
+#define WDT_ADLY_250 (WDTPW+WDTTMSEL+WDTCNTCL+WDTSSEL+WDTIS0)
+#define WDT_ADLY_16 (WDTPW+WDTTMSEL+WDTCNTCL+WDTSSEL+WDTIS1)
+#define WDT_ADLY_1_9 (WDTPW+WDTTMSEL+WDTCNTCL+WDTSSEL+WDTIS1+WDTIS0)
+#define TASSEL_0 0
+#define TASSEL_1 0x0100
+#define TASSEL_2 0x0200
+#define TASSEL_3 0x0300
+#define ID_0 0
+#define ID_3 0xC0
+#define MC_0 0
+#define MC_1 0x10
+#define MC_2 0x20
+#define TACLR 0x04
+#define TAIE 0x02
+#define TAIFG 0x01
+#define CAP 0x0100
+#define CCIE 0x0010
+#define CCIFG 0x0001
+#define COV 0x0002
+#define SCS 0x0800
+#define CM_1 0x4000
+#define CM_2 0x8000
+#define CM_3 0xC000
+#define CCIS0 0x1000
+#define CCIS1 0x2000
+#define CCIS_0 0
+#define CCIS_1 0x1000
+#define CCIS_2 0x2000
+#define CCIS_3 0x3000
+#define TA0IV_TAIFG 0x0A
+#define TA1IV_TAIFG 0x0A
+#define TA0IV_TACCR1 0x02
+#define FWKEY 0xA500
+#define FSSEL_0 0
+#define FSSEL_1 0x40
+#define FSSEL_2 0x80
+#define FSSEL0 0x40
+#define FN0 0x01
+#define FN1 0x02
+#define FN2 0x04
+#define FN3 0x08
+#define FN4 0x10
+#define FN5 0x20
+#define ERASE 0x02
+#define MERAS 0x04
+#define WRT 0x40
+#define BLKWRT 0x80
+#define LOCK 0x10
+#define LOCKA 0x40
+#define BUSY 0x01
+#define WAIT 0x08
+#define UCSWRST 0x01
+#define UCSSEL_2 0x80
+#define UCBRS_0 0
+#define UCBRS0 0x02
+#define UCBRF0 0x10
+#define UCOS16 0x01
+#define UCA0TXIE 0x02
+#define UCA0RXIE 0x01
+#define UCA0TXIFG 0x02
+#define UCA0RXIFG 0x01
+#define ADC10ON 0x10
+#define ADC10IE 0x08
+#define ADC10IFG 0x04
+#define ENC 0x02
+#define ADC10SC 0x01
+#define REFON 0x20
+#define SREF_1 0x2000
+#define ADC10SHT_3 0x1800
+#define INCH_10 0xA000
+#define ADC10DIV_3 0x60
+#define ADC10BUSY 0x01
+#define LPM0_bits 0x10
+#define LPM3_bits 0xD0
+#define GIE 0x08
+#define CPUOFF 0x10
+#define WDT_VECTOR 1
+#define TIMER0_A0_VECTOR 2
+#define TIMER0_A1_VECTOR 3
+#define PORT1_VECTOR 4
+#define USCIAB0TX_VECTOR 5
+#define USCIAB0RX_VECTOR 6
+#define TIMER1_A0_VECTOR 7
+#define TIMER1_A1_VECTOR 8
+#define ADC10_VECTOR 9
+void __delay_cycles(unsigned long);
+void __bic_SR_register_on_exit(unsigned int);
+void __bis_SR_register(unsigned int);
+void __bic_SR_register(unsigned int);
+#define UCSSEL_1 0x40
+#define UCBRS_3 0x06
+#endif
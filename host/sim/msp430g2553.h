@@ -0,0 +1,7 @@
+/*
+ msp430g2553.h
+
+ Host build for the DCO simulator, all is in msp430.h
+ */
+
+#include <msp430.h>
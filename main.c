@@ -10,6 +10,9 @@
  500kHz,1MHz,2MHz,4MHz,6MHz,8MHz,10MHz,12MHZ,16MHz
 
  But it's easy to change this values
+ The frequencies are only declared, in kHz, in the NCAL_FREQ_LIST
+ of NewDCOCal.h. Goal values, flash positions and factory seeds
+ are generated from it at compile time.
 
  The calibrated DCOCTL and BCSCTL1 values are stored in the
  flash information memory Section B.
@@ -32,6 +35,9 @@
 
     When the program starts, it checks if there is data in the
     calibration area in information area section B.
+    Data is only used if the header at the start of section B has
+    the right tag and CRC. The header is written after the data so
+    an interrupted write is calibrated again.
     If there is data it enters loop frequency mode.
     If there is no data, it calibrates the selected frequencies and
     stores the calibration data in information area section B
@@ -52,7 +58,7 @@
 
        1 32768 Hz oscilator fault
        2 One Frequency cannot be obtained
-       4 No factory DCO cal for 1MHz to guarantee flash timing
+       4 No DCO cal to guarantee flash timing
        5 A calibration has more tan the maximum allowed frequency error
 
        Continuous red led: 32768 Hz oscilator fault
@@ -66,6 +72,9 @@
 
               DCO freq = 512 diff
 
+    If the gate length is changed (ACLK_CAPTURE mode) the goal
+    values are generated for the new GATE_CYCLES length.
+
     The counter differences are averaged during NCAP cycles (50 by default) to
     reduce the error.
 
@@ -82,6 +91,224 @@
     and the final loop frequency mode, but all the information will be
     stored only on RAM so, the flash information area will not be used at all.
 
+    If the BINARY_SEARCH define is activated, the RSEL, DCO and MOD values
+    are searched by successive approximation instead of a linear scan.
+    As the frequency rises with each of them, only 4+3+5 measurements
+    are needed for each frequency instead of up to 16+8+32.
+
+    If the WARM_START define is activated, the search for each frequency
+    starts at the RSEL and DCO values found for the previous one.
+    This requires the frequencies to be calibrated in rising order.
+
+    If the FACTORY_SEED define is activated, the search for each frequency
+    starts from the factory calibration in Segment A (1, 8, 12 and 16MHz)
+    or from a value interpolated between two factory points.
+    The interpolation takes one RSEL step as SEED_RSTEP DCOCTL steps
+    (about 4.6 DCO taps), so the two coordinates do not overlap.
+    Only a neighbourhood of SEED_RANGE DCOCTL steps around the seed is
+    searched, going on in the next RSEL if the goal is past its first or
+    last DCOCTL. If the goal is not inside it, the normal search is used.
+
+    If the DECISION_MODE define is activated, the search measurements
+    end as soon as DEC_NCAP captures are all over or all under the goal
+    by more than goal/2^DEC_SHIFT. Measurements near the goal and the
+    final measurement of each search use the full NCAP average.
+
+    If the ADAPTIVE_NCAP define is activated, each measurement ends when
+    the standard error of the averaged captures is below ADAPT_PPM
+    of the mean, after at least ADAPT_MIN captures. NCAP is then
+    the maximum number of captures.
+
+    If the MEASURE_CACHE define is activated, the last CACHE_SIZE
+    measurements are kept in RAM and setDCO does not measure again
+    a DCO configuration found in the cache. If CACHE_AGE is not zero,
+    results older than CACHE_AGE measurements are measured again.
+    When a frequency must be searched again, the out of tolerance
+    result is dropped from the cache.
+
+    If the CHAR_SWEEP define is activated, the DCO is characterised
+    before the search. The central DCO of each RSEL and then all the
+    DCO steps of the RSEL ranges needed are measured once using only
+    CHAR_NCAP captures. The DCO and MOD values of each frequency are
+    interpolated from this data and one full measurement checks them.
+    The normal search is only used if the check fails.
+
+    If the LOCAL_RETRY define is activated, a frequency out of
+    the MAX_ERROR tolerance is searched again only in a neighbourhood
+    of RETRY_RANGE DCOCTL steps around the previous result.
+    The normal search is only used if the goal is not inside it.
+
+    If the ACLK_CAPTURE define is activated, ACLK, divided by
+    2^CAP_DIVA, is captured in hardware on the timer CCI0B input at
+    each edge with the capture interrupt disabled. The Watchdog, that
+    counts the same ACLK, still marks the gates, and its ISR reads
+    the capture latched by the last edge, so each gate is only one
+    interrupt (against 2, watchdog and capture, in the normal mode)
+    and the captures have no ISR latency. A read that comes after the
+    next edge moves the end of a gate and the start of the next one
+    by the same cycles, so the averages are not changed.
+    The gate is 64 divided ACLK cycles. CAP_DIVA 1 doubles it, but
+    the 16 bit count of a gate then only measures up to 16MHz.
+    The ACLK divider is kept in BCSCTL1 while the program runs but it
+    is not stored in the calibration data. TELEMETRY needs CAP_DIVA 0
+    as the UART is clocked by ACLK.
+
+    If the LONG_GATE define is activated, the error of each frequency
+    found is checked with one long gate of LONG_CYCLES ACLK cycles
+    (15.6ms, 250ms or 1s). Timer A overflows extend the captures
+    to 32 bits so the error can be computed in ppm.
+
+    If the LOW_POWER_WAIT define is activated, the CPU sleeps in LPM0
+    while it waits for captures or for the pushbutton. The capture ISR
+    wakes the CPU when the number of captures waited for is reached.
+
+    If the SETTLE_DETECT define is activated, the captures after a DCO
+    change are discarded only until two consecutive ones agree within
+    1/2^SETTLE_SHIFT. At least SETTLE_MIN and at most SETTLE_MAX
+    captures are discarded.
+
+    If the RING_FILTER define is activated, the last RING_SIZE captures
+    of each measurement are kept in a ring buffer and the median of them
+    is averaged instead of each capture. A single bad capture is then
+    rejected instead of shifting the average.
+
+    Only the frequencies selected in FREQ_MASK are calibrated and
+    written. The data of the other frequencies is kept. If the
+    STRAP_SELECT define is activated and the STRAP_PIN is grounded
+    at reset, the STRAP_MASK selection is used instead.
+    The loop frequency mode skips the frequencies without data.
+
+    If the VERIFY_MODE define is activated, a board with data in the
+    calibration area is verified before entering loop frequency mode.
+    Each stored frequency is set and measured once with VERIFY_NCAP
+    captures (about 20ms). If all are inside the MAX_ERROR tolerance
+    the program enters loop frequency mode. If not, the red led blinks
+    once for each failing frequency and only the failing ones are
+    calibrated again. Section B is then erased and written with the
+    old data of the rest.
+
+    Each DCOCTL and BCSCTL1 pair is written as one word. The flash
+    timing generator uses the fastest frequency calibrated, divided
+    to be as near FTG_MAX as allowed. If no calibrated frequency can
+    be used, the factory 1MHz data is used.
+    If the DRIFT_CORRECT define is activated, the frequency in loop
+    frequency mode is measured again each DRIFT_PERIOD captures
+    averaging DRIFT_NCAP captures. If the error is over goal/2^DRIFT_SHIFT
+    DCOCTL is moved one step (one MOD step) to correct the drift.
+    The corrected value is not stored in flash.
+
+    The factory 1MHz data is only needed if no calibrated frequency can
+    be used. At start, in errors and between operations the DCO is set
+    to the factory 1MHz data, or if Segment A has been erased, to the
+    calibrated frequency nearest to 1MHz or to the reset default DCO.
+    If the REBUILD_SEGA define is activated and Segment A is blank, the
+    1, 8, 12 and 16MHz calibrations are also written in Segment A with
+    the factory TLV tag and checksum. These frequencies must be in
+    the NCAL_FREQ_LIST.
+    If the FLASH_BLOCK define is activated, all the calibration words
+    are written in one block write using a function placed in RAM.
+
+    If the APPEND_RECORDS define is activated, the fixed positions are
+    not used. Each calibration is appended as a new record with a
+    counter and a CRC in the free space of Segments B, C and D
+    (see NewDCOCal.h). A segment is only erased when the record must
+    be written on it and it is not blank, so repeat calibrations are
+    write only. At start the newest valid record is used.
+    FLASH_OVERRIDE then appends a new record without erasing.
+
+    If the TEMP_BINS define is activated, the internal ADC10 temperature
+    sensor is read at start averaging TEMP_NREAD conversions. The
+    calibration is stored in the set of its temperature bin: bin 0 in
+    Segment B, bin 1 in Segment C and bin 2 in Segment D, each one with
+    its own header and CRC (see NewDCOCal.h). Calibrating the board at
+    several temperatures fills the sets of each bin. Only the set of
+    the current bin is checked, verified, erased or written.
+
+    If the TELEMETRY define is activated, the results are sent over
+    the USCI_A0 UART (TXD at P1.2, 9600 baud 8N1 from ACLK) through a
+    ring buffer emptied by the TX interrupt, so the measurement never
+    waits for the UART. If the buffer is full the characters are lost
+    and counted. The F and P lines, and in COMMAND_MODE all the
+    replies, wait for space instead as they are never sent during a
+    measurement. Each line has a letter and comma separated fields:
+
+       S,nfreq,mask                          Start of calibration
+       T,rsel,dco,mod,n                      Each setDCO (TRACE_SEARCH)
+       F,i,hz,rsel,dco,mod,n,goal,ppm,sets,ms  Frequency i calibrated
+       W,ms,lost                             Flash written
+       L,flash                               Loop frequency mode
+       E,error                               Error lock
+
+    n is the averaged count, sets the number of setDCO calls for the
+    frequency and ms the time from the start measured in ACLK cycles.
+    If TEL_BLINK is 0 the led blinks and their pauses are skipped
+    during calibration. Error codes still blink.
+
+    If the COMMAND_MODE define is activated (it needs TELEMETRY), the
+    board does not start by itself. It waits for command lines from a
+    host on the UART RXD (P1.1), ended with CR or LF:
+
+       M,mask   Select the frequencies to calibrate
+       C        Calibrate the selected frequencies (F lines)
+       V        Measure the stored data of the selected frequencies
+                Sends V,i,n,goal,ppm for each one with data
+       D        Dump the stored data, D,i,hz,dcoctl,bcsctl1 for each one
+       W        Write the last calibration to flash (W line)
+       L        Enter loop frequency mode from flash
+       H        Measure the TA0CLK frequency (FREQ_COUNTER)
+       A        Measure and write the dense DCO map (MAP_BUILD)
+
+    Each command ends with a K line, or a ? line if it is not valid.
+    W before any C is not valid. An error lock sends its E line and
+    no K. The host tool in host/calhost.c drives many boards at once.
+
+    If the INSTRUMENT define is activated, the Inst structure counts
+    for each frequency the setDCO calls, the averaged and discarded
+    gates, the repeated searches and the search time. It also keeps
+    the startClk32 loops (about 1ms each, ACLK is not running yet) and
+    the flashWrite time, and with FACTORY_SEED the seed searches and
+    how many found the goal. Times are in ACLK cycles read from
+    Timer1_A3, that keeps counting when interrupts are disabled. With
+    ACLK_CAPTURE the timer counts divided ACLK and its count is scaled
+    back to ACLK cycles. With TELEMETRY the data is also sent:
+
+       P,i,sets,gates,discarded,retries,ticks  After each F line
+       G,clk32loops,flashticks                 After the W line
+
+    If the LOOP_SLEEP define is activated, the loop frequency mode does
+    not poll the switch. The switch edge generates a port 1 interrupt
+    that wakes the CPU, and further edges are ignored until the switch
+    has been released for DEBOUNCE_TICKS watchdog intervals. The
+    captures are stopped and the watchdog only interrupts each 250ms
+    (LOOP_WDT, 500ms with ACLK_CAPTURE and CAP_DIVA 1, as the watchdog
+    counts divided ACLK) to blink the green led and to debounce. The
+    blink does not follow the frequency as the Timer A overflow blink
+    of the polled loop does. The CPU sleeps
+    in LPM0 so SMCLK stays at P1.4, or in LPM3 if LOOP_SMCLK is 0.
+    With DRIFT_CORRECT the captures are started again about each
+    DRIFT_PERIOD gates only for the drift measurement.
+
+    If the FREQ_COUNTER define is activated (it needs TELEMETRY), the
+    board measures the frequency of an external signal instead of
+    calibrating. The signal clocks Timer A through the TA0CLK pin
+    (P1.0, remove the red led jumper) and the same 32768Hz gates and
+    capture ISR count its edges. COUNT_NMEAS measurements of NCAP gates
+    are added, about 1s and 1Hz of resolution, and sent as H,hz lines.
+    P1.0 is never an output in this mode, so the red led is not used
+    and the error codes are only sent as E lines. With COMMAND_MODE
+    the board takes commands and each H command sends one measurement.
+
+    If the MAP_BUILD define is activated, after the flash write every
+    RSEL and DCO point with MOD 0 from NCAL_MAP_RSEL0 up is measured
+    with MAP_NCAP gates and a dense map of their frequencies is written
+    to Segments D and C (layout in NewDCOCal.h). MCLK is DCO/2 during
+    the sweep so the CPU stays in spec at the highest points. Then
+    ncal_map_set() finds the DCO configuration for any frequency from
+    the map without measuring, so a new clock, like an exact baud rate
+    multiple, needs no new calibration. With TELEMETRY an A,clamped
+    line gives the number of map differences that were out of range,
+    and in COMMAND_MODE the A command builds the map.
+
    */
 
 /********** CONDITIONAL COMPILATION DEFINES ************************/
@@ -98,8 +325,143 @@
 // Debug define
 //#define DEBUG   // Eliminate to reduce code and memory usage
 
+// Binary search
+// If active, searchGoal uses successive approximation
+// instead of a linear scan of RSEL, DCO and MOD
+//#define BINARY_SEARCH
+
+// Warm start
+// If active, each frequency search starts from the
+// RSEL and DCO values found for the previous frequency
+// NCAL_FREQ_LIST must be in rising order
+//#define WARM_START
+
+// Factory seed
+// If active, each frequency search starts from the factory
+// calibration data in Segment A
+//#define FACTORY_SEED
+
+// Decision mode
+// If active, search measurements end early when they are
+// clearly over or under the goal
+//#define DECISION_MODE
+
+// Adaptive NCAP
+// If active, measurements end when the standard error
+// of the mean is low enough
+//#define ADAPTIVE_NCAP
+
+// Measurement cache
+// If active, setDCO reuses recent measurements
+//#define MEASURE_CACHE
+
+// Characterisation sweep
+// If active, all frequencies are obtained from one DCO sweep
+//#define CHAR_SWEEP
+
+// Local retry
+// If active, retries search near the previous result
+//#define LOCAL_RETRY
+
+// ACLK capture
+// If active, ACLK is captured in hardware instead
+// of using Watchdog generated software captures
+//#define ACLK_CAPTURE
+
+// Long gate
+// If active, the final error of each frequency is
+// measured with one long gate
+//#define LONG_GATE
+
+// Low power wait
+// If active, the CPU waits for captures in LPM0
+//#define LOW_POWER_WAIT
+
+// Settling detection
+// If active, averaging starts when the DCO is stable
+// instead of after a fixed number of captures
+//#define SETTLE_DETECT
+
+// Ring filter
+// If active, a median of the last captures is averaged
+//#define RING_FILTER
+
+// Strap selection
+// If active, a grounded strap pin at reset
+// selects the STRAP_MASK frequencies
+//#define STRAP_SELECT
+
+// Verify mode
+// If active, stored calibration data is verified and
+// only failing frequencies are calibrated again
+//#define VERIFY_MODE
+
+// Flash block write
+// If active, calibration data is written with a
+// block write executed from RAM
+//#define FLASH_BLOCK
+
+// Append records
+// If active, each calibration is appended as a record
+// in Segments B, C and D instead of fixed positions
+//#define APPEND_RECORDS
+
+// Rebuild Segment A
+// If active, the factory DCO data is written again
+// from the calibration if Segment A is blank
+//#define REBUILD_SEGA
+
+// Drift correction
+// If active, loop frequency mode corrects the DCO drift
+// against the 32768 Hz crystal
+//#define DRIFT_CORRECT
+
+// Temperature bins
+// If active, the calibration is stored in the set
+// of the current temperature bin
+//#define TEMP_BINS
+
+// Telemetry
+// If active, results are sent over the UART
+//#define TELEMETRY
+
+// Command mode
+// If active, the board is driven by UART commands
+// Needs TELEMETRY
+//#define COMMAND_MODE
+
+// Instrumentation
+// If active, the calibration phases are counted and timed
+//#define INSTRUMENT
+
+// Loop sleep
+// If active, the loop frequency mode sleeps
+// between switch interrupts
+//#define LOOP_SLEEP
+
+// Frequency counter
+// If active, the frequency at the TA0CLK pin is measured
+// Needs TELEMETRY
+//#define FREQ_COUNTER
+
+// Dense DCO map
+// If active, the frequency of all DCO points
+// is stored in Segments D and C
+//#define MAP_BUILD
+
 /***************** OTHER OPERATION DEFINES *****************************/
 
+// Allowed flash timing generator frequency in Hz
+#define FTG_MIN 257000
+#define FTG_MAX 476000
+
+// Frequencies to calibrate
+// Use FREQ_BIT(name) for each NCAL_FREQ_LIST entry or FREQ_ALL
+#define FREQ_MASK FREQ_ALL
+
+// Frequencies to calibrate if the strap is grounded (STRAP_SELECT)
+#define STRAP_MASK (FREQ_BIT(8MHZ)|FREQ_BIT(16MHZ))
+
 // Max allowed error (in %)
 #define MAX_ERROR 5
 
@@ -109,6 +471,102 @@
 // Number of captures to average
 #define NCAP 50
 
+// Max distance in DCOCTL steps from the factory seed (FACTORY_SEED)
+#define SEED_RANGE 64
+
+// DCOCTL steps of one RSEL step, about 4.6 DCO taps (FACTORY_SEED)
+#define SEED_RSTEP 148
+
+// Captures needed for an early decision (DECISION_MODE)
+#define DEC_NCAP 4
+
+// Decision margin is goal/2^DEC_SHIFT (DECISION_MODE)
+#define DEC_SHIFT 8
+
+// Target standard error of the mean in ppm (ADAPTIVE_NCAP)
+#define ADAPT_PPM 100
+
+// Minimum number of captures to average (ADAPTIVE_NCAP)
+#define ADAPT_MIN 4
+
+// Number of cached measurements, 6 bytes of RAM each (MEASURE_CACHE)
+#define CACHE_SIZE 16
+
+// Max age of cached measurements, 0 for no limit (MEASURE_CACHE)
+#define CACHE_AGE 0
+
+// Captures to average for each sweep point (CHAR_SWEEP)
+#define CHAR_NCAP 4
+
+// Captures to discard for each sweep point (CHAR_SWEEP)
+#define CHAR_SETTLE 2
+
+// Max distance in DCOCTL steps from the previous result (LOCAL_RETRY)
+#define RETRY_RANGE 32
+
+// ACLK divider 0..1 for /1 /2 (ACLK_CAPTURE)
+#define CAP_DIVA 0
+
+// ACLK cycles in the long gate (LONG_GATE)
+// 512 (15.6ms), 8192 (250ms) or 32768 (1s)
+#define LONG_CYCLES 8192
+
+// Min and max captures discarded after a DCO change (SETTLE_DETECT)
+#define SETTLE_MIN 1
+#define SETTLE_MAX 5
+
+// Tolerance between captures is 1/2^SETTLE_SHIFT (SETTLE_DETECT)
+#define SETTLE_SHIFT 8
+
+// Captures in the median filter, 7 max to keep the ISR short (RING_FILTER)
+#define RING_SIZE 3
+
+// Captures to average for each stored frequency (VERIFY_MODE)
+#define VERIFY_NCAP 8
+
+// Captures to discard for each stored frequency (VERIFY_MODE)
+#define VERIFY_SETTLE 2
+
+// Captures between drift corrections, 512 is about 1s (DRIFT_CORRECT)
+#define DRIFT_PERIOD 512
+
+// Captures to average for each drift correction (DRIFT_CORRECT)
+#define DRIFT_NCAP 32
+
+// Drift threshold is goal/2^DRIFT_SHIFT (DRIFT_CORRECT)
+// Must be over half a MOD step (about 1/800)
+#define DRIFT_SHIFT 9
+
+// Sensor conversions to average at start (TEMP_BINS)
+#define TEMP_NREAD 4
+
+// UART ring buffer size, must be a power of 2 (TELEMETRY)
+#define TX_SIZE 64
+
+// Send each setDCO point if 1 (TELEMETRY)
+#define TRACE_SEARCH 0
+
+// Keep the led blinks in calibration if 1 (TELEMETRY)
+#define TEL_BLINK 0
+
+// Command line buffer size (COMMAND_MODE)
+#define RX_SIZE 16
+
+// Keep SMCLK at P1.4 sleeping in LPM0 if 1, if 0 use LPM3 (LOOP_SLEEP)
+#define LOOP_SMCLK 1
+
+// Watchdog intervals the switch must be released (LOOP_SLEEP)
+#define DEBOUNCE_TICKS 1
+
+// Measurements of NCAP gates in each count, 10 is about 1s (FREQ_COUNTER)
+#define COUNT_NMEAS 10
+
+// Gates measured for each DCO point (MAP_BUILD)
+#define MAP_NCAP 32
+
+// Gates discarded after each DCO point change (MAP_BUILD)
+#define MAP_SETTLE 2
+
 /********************* INCLUDES ***************************************/
 
 #include <msp430.h>
@@ -119,35 +577,207 @@
 
 /******************** OTHER DEFINES **********************************/
 
+// In FREQ_COUNTER mode P1.0 is the counter input so the red
+// led is not used and the pin is never an output
+#ifdef FREQ_COUNTER
+#define LED_RED     0
+#else
 #define LED_RED     BIT0             // Red LED at P1.0
+#endif
 #define LED_GREEN   BIT6             // Green LED at P1.6
 #define F_OUT       BIT5             // Freq out for CLK32/128
 #define SMCLK_PIN   BIT4             // SMCLK output at P1.4
 #define SWITCH      BIT3             // Switch input
+#define STRAP_PIN   BIT7             // Strap input at P1.7
+#define UART_TXD    BIT2             // UART TXD at P1.2
+#define UART_RXD    BIT1             // UART RXD at P1.1
+#define COUNT_PIN   BIT0             // TA0CLK input at P1.0 (red led)
+
+// Modes where a measurement can average less than NCAP captures
+#if defined(DECISION_MODE) || defined(ADAPTIVE_NCAP)
+#define VARIABLE_NCAP
+#endif
+
+// ACLK divider bits to keep in BCSCTL1, its shift
+// and ACLK cycles in each gate
+// The Watchdog gate is 64 divided ACLK cycles
+#ifdef ACLK_CAPTURE
+#if (CAP_DIVA>1)
+#error "CAP_DIVA must be 0 or 1, the count of a gate is 16 bits"
+#endif
+#define BC1_DIVA (CAP_DIVA*DIVA0)
+#define ACLK_SHIFT CAP_DIVA
+#else
+#define BC1_DIVA 0
+#define ACLK_SHIFT 0
+#endif
+#define GATE_CYCLES (64<<ACLK_SHIFT)
+
+// Watchdog setting for the long gate
+#ifdef LONG_GATE
+#if ((LONG_CYCLES>>ACLK_SHIFT)==512)
+#define LONG_WDT WDT_ADLY_16
+#elif ((LONG_CYCLES>>ACLK_SHIFT)==8192)
+#define LONG_WDT WDT_ADLY_250
+#elif ((LONG_CYCLES>>ACLK_SHIFT)==32768)
+#define LONG_WDT WDT_ADLY_1000
+#else
+#error "LONG_CYCLES must be 512, 8192 or 32768, times 2^CAP_DIVA in ACLK_CAPTURE"
+#endif
+#endif
+
+// Modes that search near a given DCO configuration
+#if defined(FACTORY_SEED) || defined(LOCAL_RETRY)
+#define LOCAL_SEARCH
+#endif
+
+// Offset of the current temperature bin set from Segment B
+#ifdef TEMP_BINS
+#ifdef APPEND_RECORDS
+#error "TEMP_BINS uses Segments C and D, it cannot be used with APPEND_RECORDS"
+#endif
+#define BIN_OFS NCAL_BIN_OFS(tempBin)
+#else
+#define BIN_OFS 0
+#endif
+
+// The UART needs ACLK at 32768Hz
+#if defined(TELEMETRY) && defined(ACLK_CAPTURE) && (CAP_DIVA!=0)
+#error "TELEMETRY needs CAP_DIVA 0 in ACLK_CAPTURE mode"
+#endif
+
+// Watchdog interval in loop sleep mode, 8192 watchdog
+// cycles (250ms if ACLK is not divided), and its ACLK cycles
+#ifdef LOOP_SLEEP
+#define LOOP_WDT    WDT_ADLY_250
+#define LOOP_CYCLES (8192L<<ACLK_SHIFT)
+
+// Low power mode to sleep
+#if LOOP_SMCLK
+#define LOOP_LPM LPM0_bits
+#else
+#define LOOP_LPM LPM3_bits
+#endif
+
+// Watchdog intervals between drift corrections
+// and condition to wake the loop
+#ifdef DRIFT_CORRECT
+#define DRIFT_TICKS ((DRIFT_PERIOD*(long)GATE_CYCLES+LOOP_CYCLES-1)/LOOP_CYCLES)
+#define LOOP_WAKE   (pressed||(loopTicks>=DRIFT_TICKS))
+#else
+#define LOOP_WAKE   (pressed)
+#endif
+#endif
+
+// The frequency counter results are sent with the telemetry UART
+#if defined(FREQ_COUNTER) && !defined(TELEMETRY)
+#error "FREQ_COUNTER needs TELEMETRY"
+#endif
+
+// The dense DCO map uses Segments C and D
+// Hz are computed from the gate counts with a shift
+#ifdef MAP_BUILD
+#if defined(TEMP_BINS) || defined(APPEND_RECORDS)
+#error "MAP_BUILD uses Segments C and D, it cannot be used with TEMP_BINS or APPEND_RECORDS"
+#endif
+#if (MAP_NCAP>NCAP)
+#error "MAP_NCAP cannot be over NCAP"
+#endif
+#if ((32768/GATE_CYCLES)*GATE_CYCLES!=32768)
+#error "MAP_BUILD needs a power of two GATE_CYCLES"
+#endif
+#endif
+
+// Commands are received with the telemetry UART
+#if defined(COMMAND_MODE) && !defined(TELEMETRY)
+#error "COMMAND_MODE needs TELEMETRY"
+#endif
 
 /******** Constants with data for the frequecies to scan *************/
 
+// All tables are generated from NCAL_FREQ_LIST in NewDCOCal.h
+
 // Number of frequencies to scan
-#define NFREQ 9
+#define NFREQ NCAL_NFREQ
 
-// Scan frequencies in kHz
-#ifdef DEBUG
-const unsigned int  FreqK[NFREQ] ={500,1000,2000,4000,6000 ,8000 ,10000,12000,16000};
+// Selection bit for a frequency and for all of them
+#define FREQ_BIT(name) (1UL<<NCAL_IDX_##name)
+#define FREQ_ALL       (0xFFFFFFFFUL>>(32-NFREQ))
+
+// Goal counter value for a frequency in kHz (freq(Hz)*GATE_CYCLES/32768)
+#define GOAL_N(k) ((unsigned int)((k)*(1000.0*GATE_CYCLES/32768)+0.5))
+
+// Distance of a counter value to the 1MHz goal
+#define DIST_1MHZ(n) (((n)>GOAL_N(1000))?((n)-GOAL_N(1000)):(GOAL_N(1000)-(n)))
+
+// Goal counter values must fit in 16 bits
+#define GOAL_CHECK_(k,name,pos) typedef char GoalFits_##name \
+                    [(((long)(k)+1)*GATE_CYCLES<=(65535L*32768/1000))?1:-1];
+NCAL_FREQ_LIST(GOAL_CHECK_)
+
+// Scan frequencies in Hz
+#if defined(DEBUG) || defined(LONG_GATE) || defined(TELEMETRY)
+#define FREQ_HZ_(k,name,pos) (unsigned long)((k)*1000.0+0.5),
+const unsigned long FreqHz[NFREQ]={NCAL_FREQ_LIST(FREQ_HZ_)};
 #endif
 
-// Goal counter values for each frequency (freq(Hz)/512)
-const unsigned int  GoalN[NFREQ] ={977,1953,3906,7813,11719,15625,19531,23438,31250};
+// Goal counter values for each frequency
+#define GOAL_N_(k,name,pos) GOAL_N(k),
+const unsigned int  GoalN[NFREQ] ={NCAL_FREQ_LIST(GOAL_N_)};
 
 // Calibration data position for each frequency (from NewDCOCal.h)
-const unsigned int  CalPos[NFREQ]={NCALDCO_500kHZ_
-                                  ,NCALDCO_1MHZ_
-                                  ,NCALDCO_2MHZ_
-                                  ,NCALDCO_4MHZ_
-                                  ,NCALDCO_6MHZ_
-                                  ,NCALDCO_8MHZ_
-                                  ,NCALDCO_10MHZ_
-                                  ,NCALDCO_12MHZ_
-                                  ,NCALDCO_16MHZ_};
+#define CAL_POS_(k,name,pos) (pos),
+const unsigned int  CalPos[NFREQ]={NCAL_FREQ_LIST(CAL_POS_)};
+
+// Calibration records must fit in a segment (Only in APPEND_RECORDS mode)
+#ifdef APPEND_RECORDS
+typedef char RecordFits[(NCAL_REC_PER_SEG>0)?1:-1];
+#endif
+
+// Blank data for frequencies without valid stored data
+const unsigned int NoData=0xFFFF;
+
+// Seed data for each frequency (Only in FACTORY_SEED mode)
+// Seed is interpolated between two factory DCOCTL positions
+// using log(freq) and a weight in 1/256 units
+// The BCSCTL1 factory value is in the next position
+#ifdef FACTORY_SEED
+
+// Factory frequencies used as seeds for a frequency in kHz
+// Below 8MHz the 1MHz and 8MHz data is used
+#define SEED_KA(k) ((k)<8000?1000:(k)<12000?8000:(k)<16000?12000:16000)
+#define SEED_KB(k) ((k)<8000?8000:(k)<12000?12000:(k)<16000?16000:12000)
+
+// Factory data position for 1, 8, 12 and 16MHz
+#define SEED_POS(f) ((f)==1000?CALDCO_1MHZ_:(f)==8000?CALDCO_8MHZ_: \
+                     (f)==12000?CALDCO_12MHZ_:CALDCO_16MHZ_)
+
+// Integer part of log2(x) for x up to 65535
+#define LOG2_I(x) ((x)>=32768?15:(x)>=16384?14:(x)>=8192?13:(x)>=4096?12: \
+                   (x)>=2048?11:(x)>=1024?10:(x)>=512?9:(x)>=256?8: \
+                   (x)>=128?7:(x)>=64?6:(x)>=32?5:(x)>=16?4: \
+                   (x)>=8?3:(x)>=4?2:(x)>=2?1:0)
+
+// Fractional part of log2(x) in 1/256 units
+// Uses log2(1+m)=m+m(1-m)(0.43-0.16m) with error near 1/256
+#define LOG2_M(x) ((long)((x)*256.0)/(1L<<LOG2_I(x))-256)
+#define LOG2_F(x) (LOG2_M(x)+(LOG2_M(x)*(256-LOG2_M(x))* \
+                   (111-(42*LOG2_M(x))/256))/65536)
+
+// log2(x) in 1/256 units
+#define LOG2_Q8(x) (256L*LOG2_I(x)+LOG2_F(x))
+
+// Seed weight for a frequency in kHz
+#define SEED_W(k) ((int)((256*(LOG2_Q8(k)-LOG2_Q8(SEED_KA(k))))/ \
+                         (LOG2_Q8(SEED_KB(k))-LOG2_Q8(SEED_KA(k)))))
+
+#define SEED_A_(k,name,pos) SEED_POS(SEED_KA(k)),
+#define SEED_B_(k,name,pos) SEED_POS(SEED_KB(k)),
+#define SEED_W_(k,name,pos) SEED_W(k),
+const unsigned int  SeedA[NFREQ]={NCAL_FREQ_LIST(SEED_A_)};
+const unsigned int  SeedB[NFREQ]={NCAL_FREQ_LIST(SEED_B_)};
+const int           SeedW[NFREQ]={NCAL_FREQ_LIST(SEED_W_)};
+#endif
 
 /*************** VARIABLES **********************************/
 
@@ -156,12 +786,74 @@ const unsigned int  CalPos[NFREQ]={NCALDCO_500kHZ_
 unsigned char CalDCO[NFREQ];
 unsigned char CalBC1[NFREQ];
 
+// Frequencies selected for calibration
+unsigned long FreqMask=FREQ_MASK;
+
+// Fastest calibrated frequency, used for flash timing
+unsigned int FlashN=0;        // Averaged difference (0 if none)
+unsigned char FlashDCO;       // DCOCTL
+unsigned char FlashBC1;       // BCSCTL1
+
+// Newest calibration record (Only in APPEND_RECORDS mode)
+// or valid header of the stored data
+#ifdef APPEND_RECORDS
+uint16_t *Record=0;      // Record data (0 if none)
+int recPos=-1;           // Record slot
+#else
+char calValid=0;         // Header and CRC are correct
+#endif
+
+// Current temperature bin (Only in TEMP_BINS mode)
+#ifdef TEMP_BINS
+int tempBin=0;
+unsigned int TempCode;   // Averaged ADC10 sensor code
+#endif
+
+// Calibrated frequency nearest to 1MHz, used if there
+// is no factory 1MHz data
+unsigned int SlowN=0;         // Averaged difference (0 if none)
+unsigned char SlowDCO;        // DCOCTL
+unsigned char SlowBC1;        // BCSCTL1
+
+// Erase section B before writing
+#ifdef FLASH_OVERRIDE
+char flashErase=1;
+#else
+char flashErase=0;
+#endif
+
 // Data found for each frequency (Only in DEBUG mode)
 #ifdef DEBUG
 unsigned char FoundRsel[NFREQ];  // RSEL value
 unsigned char FoundDco[NFREQ];   // DCO value
 unsigned char FoundMod[NFREQ];   // Modulation value
          char FoundErr[NFREQ];   // Frequency error in %
+#ifdef LONG_GATE
+long int FoundPpm[NFREQ];        // Frequency error in ppm
+#endif
+#endif
+
+// Calibration counters and times (Only in INSTRUMENT mode)
+// Times are in ACLK cycles
+#ifdef INSTRUMENT
+struct
+    {
+	unsigned int  clk32Loops;       // startClk32 loops
+	unsigned long flashTicks;       // flashWrite time
+	unsigned int  sets[NFREQ];      // setDCO calls
+	unsigned int  gates[NFREQ];     // Averaged gates
+	unsigned int  discarded[NFREQ]; // Discarded gates
+	unsigned char retries[NFREQ];   // Repeated searches
+	unsigned long ticks[NFREQ];     // Search time
+    #ifdef FACTORY_SEED
+	unsigned int  seeds;            // seedSearch calls
+	unsigned int  seedHits;         // Seed searches that found the goal
+    #endif
+    } Inst;
+volatile unsigned int instGates;    // Gates of the current frequency
+volatile unsigned int instDisc;
+unsigned int instHigh=0;            // Timer1_A3 overflows
+unsigned long instT0;               // Start of the current frequency
 #endif
 
 // Last captured value on Timerer A2 module 0
@@ -176,6 +868,93 @@ unsigned int AveragedDifference;
 // Number of captures
 volatile int ncap=0;
 
+// UART telemetry data (Only in TELEMETRY mode)
+#ifdef TELEMETRY
+char TxBuf[TX_SIZE];               // Ring buffer
+volatile unsigned char txHead=0;   // Next position to store
+volatile unsigned char txTail=0;   // Next position to send
+unsigned int txLost=0;             // Characters lost
+char txWait=0;                     // Wait for space if not 0
+volatile unsigned long Ticks=0;    // ACLK cycles from start
+#endif
+
+// setDCO calls of the current frequency
+#if defined(TELEMETRY) || defined(INSTRUMENT)
+unsigned int nsets=0;
+#endif
+
+// Loop sleep data (Only in LOOP_SLEEP mode)
+#ifdef LOOP_SLEEP
+volatile char pressed=0;           // Switch pressed
+volatile char loopSlow=0;          // Watchdog in slow interval
+volatile unsigned char debounce;   // Intervals until released
+volatile unsigned int loopTicks=0; // Intervals since last drift correction
+#endif
+
+// Host command data (Only in COMMAND_MODE)
+#ifdef COMMAND_MODE
+char RxLine[RX_SIZE];              // Command line
+int rxPos=0;                       // Next position to store
+volatile char rxReady=0;           // Command line complete
+char calDone=0;                    // There is a calibration to write
+#endif
+
+// Settling detection data (Only in SETTLE_DETECT mode)
+#ifdef SETTLE_DETECT
+volatile char settle=0;  // Settling detection in progress
+int ndisc;               // Captures discarded
+#endif
+
+// Ring buffer of captures (Only in RING_FILTER mode)
+#ifdef RING_FILTER
+unsigned int Ring[RING_SIZE];  // Last captured differences
+int ringPos;                   // Next position to store
+int nring;                     // Number of stored differences
+#endif
+
+// Number of captures that wakes the CPU (Only in LOW_POWER_WAIT mode)
+#ifdef LOW_POWER_WAIT
+volatile int ncapWake=0;
+#endif
+
+// Early decision data (Only in DECISION_MODE)
+#ifdef DECISION_MODE
+volatile unsigned int DecisionGoal=0; // Goal to decide on (0 for no decision)
+unsigned int DecisionMargin;          // Margin over and under the goal
+int nside;                            // Captures over (+) or under (-) goal
+#endif
+
+// Variance data (Only in ADAPTIVE_NCAP mode)
+// Differences are taken against the first averaged capture
+#ifdef ADAPTIVE_NCAP
+unsigned int RefDifference;  // First averaged capture
+int S1;                      // Sum of differences to reference
+unsigned long S2;            // Sum of squared differences to reference
+#endif
+
+// Number of averaged captures
+#ifdef VARIABLE_NCAP
+volatile int nmean;
+#endif
+
+// Measurement cache (Only in MEASURE_CACHE mode)
+// Empty entries have BCSCTL1=0 as XT2OFF is always set
+#ifdef MEASURE_CACHE
+unsigned char CacheBC1[CACHE_SIZE];  // BCSCTL1 value
+unsigned char CacheDCO[CACHE_SIZE];  // DCOCTL value
+unsigned int  CacheN[CACHE_SIZE];    // Averaged difference
+unsigned int  CacheTime[CACHE_SIZE]; // Measurement number
+unsigned int  cacheTime=0;           // Number of measurements
+int cacheNext=0;                     // Next entry to replace
+char cached=0;                       // Last setDCO result is from the cache
+#endif
+
+// Sweep data for one RSEL range (Only in CHAR_SWEEP mode)
+#ifdef CHAR_SWEEP
+unsigned int Row[8];   // Averaged difference for each DCO
+int RowRsel=-1;        // RSEL of Row data
+#endif
+
 // Current oscilator values during calibration
 int rsel=0;
 int dco=0;
@@ -184,9 +963,35 @@ int mod=0;
 // Long value to average
 unsigned long int Mean;
 
+// Long gate data (Only in LONG_GATE mode)
+#ifdef LONG_GATE
+volatile char longGate=0;     // Long gate in progress
+unsigned int TarHigh;         // Timer A overflows (High word of TAR)
+unsigned long LastLong=0;     // Last 32 bit capture
+unsigned long LongDifference; // Last 32 bit difference
+#endif
+
 // Blink counter
 int bcount=0;
 
+// Search lower bounds (Only in WARM_START mode)
+// RSEL and DCO found for the previous frequency
+#ifdef WARM_START
+int startRsel=0;
+int startDco=0;
+#endif
+
+// First RSEL and DCO values to search
+// If warm start is not used the search always starts at 0
+// The previous DCO is only a bound if RSEL has not changed
+#ifdef WARM_START
+ #define FIRST_RSEL  startRsel
+ #define FIRST_DCO   ((rsel==startRsel)?startDco:0)
+#else
+ #define FIRST_RSEL  0
+ #define FIRST_DCO   0
+#endif
+
 /*************************** FUNCTIONS **********************/
 
 
@@ -204,6 +1009,240 @@ void longDelay()
 	 __delay_cycles(10000);
  }
 
+#ifdef TELEMETRY
+
+// Stores a character in the UART ring buffer
+// The TX interrupt sends it, if the buffer is full it is lost
+// unless txWait is set, then it waits for space with the
+// interrupts enabled (never during a measurement)
+void txChar(char c)
+ {
+ unsigned char next;
+
+ next=(txHead+1)&(TX_SIZE-1);
+ if (next==txTail)
+     {
+	 if (!txWait)
+	     {
+		 txLost++;
+		 return;
+	     }
+	 while (next==txTail);
+     }
+ TxBuf[txHead]=c;
+ txHead=next;
+
+ // Start sending
+ SET_FLAG(IE2,UCA0TXIE);
+ }
+
+// Stores a comma and a signed decimal number
+void txNum(long x)
+ {
+ char d[10];
+ int n=0;
+ unsigned long u;
+
+ txChar(',');
+ if (x<0) txChar('-');
+ u=(x<0)?-x:x;
+ do
+   {
+   d[n++]='0'+(u%10);
+   u/=10;
+   }
+   while (u);
+ while (n) txChar(d[--n]);
+ }
+
+// Ends a line
+void txEnd()
+ {
+ txChar('\r');
+ txChar('\n');
+ }
+
+// Milliseconds from start
+long txMs()
+ {
+ unsigned long t;
+
+ dint();
+ t=Ticks;
+ eint();
+ // t*1000/32768 without overflow
+ return (long)((t>>12)*125+(((t&4095)*125)>>12));
+ }
+
+// Configures the UART at 9600 baud from ACLK
+void txStart()
+ {
+ SET_FLAG(UCA0CTL1,UCSWRST);
+ UCA0CTL1=UCSWRST+UCSSEL_1;    // ACLK
+ UCA0BR0=3;                    // 32768/9600=3.41
+ UCA0BR1=0;
+ UCA0MCTL=UCBRS_3;             // 0.41*8=3
+ SET_FLAG(P1SEL,UART_TXD);
+ SET_FLAG(P1SEL2,UART_TXD);
+ RESET_FLAG(UCA0CTL1,UCSWRST);
+
+ // Receive commands
+ #ifdef COMMAND_MODE
+ SET_FLAG(P1SEL,UART_RXD);
+ SET_FLAG(P1SEL2,UART_RXD);
+ SET_FLAG(IE2,UCA0RXIE);
+ #endif
+ }
+
+// Error of the last measure of frequency i in ppm
+// The count of each gate, in 1/4096 counts, is compared with the
+// exact goal, freq(Hz)*GATE_CYCLES/32768, so there is no truncation
+// or goal rounding
+// All operations are done in 32 bits
+long txPpm(int i)
+ {
+ int n,k;
+ char neg;
+ unsigned long m,goal,e;
+ long ppm;
+
+ #ifdef VARIABLE_NCAP
+ n=nmean;
+ #else
+ n=NCAP;
+ #endif
+
+ // A cached result is not in Mean, its truncated
+ // count gets half a count
+ #ifdef MEASURE_CACHE
+ if (cached)
+	 m=(((unsigned long)AveragedDifference)<<12)+2048;
+    else
+ #endif
+	 m=((Mean/n)<<12)+(((Mean%n)<<12)/n);
+
+ goal=(FreqHz[i]*GATE_CYCLES)>>3;
+
+ // Error in 1/4096 counts
+ neg=(m<goal);
+ e=neg?(goal-m):(m-goal);
+
+ // e*1000000/goal one decimal digit at a time
+ // so nothing overflows
+ ppm=e/goal;
+ e%=goal;
+ for(k=0;k<6;k++)
+     {
+	 e*=10;
+	 ppm=ppm*10+e/goal;
+	 e%=goal;
+     }
+
+ return neg?-ppm:ppm;
+ }
+
+// Sends the result of frequency i
+void txFreq(int i,long ppm)
+ {
+ txChar('F');
+ txNum(i);
+ txNum(FreqHz[i]);
+ txNum(rsel);
+ txNum(dco);
+ txNum(mod);
+ txNum(AveragedDifference);
+ txNum(GoalN[i]);
+ txNum(ppm);
+ txNum(nsets);
+ txNum(txMs());
+ txEnd();
+ }
+
+#endif // TELEMETRY
+
+#ifdef INSTRUMENT
+
+// ACLK cycles from the start of Timer1_A3
+// The timer is read until two reads agree as ACLK
+// is not synchronous with MCLK
+// In ACLK_CAPTURE mode the timer counts divided ACLK
+// so its count is scaled back to ACLK cycles
+unsigned long instTime()
+ {
+ unsigned int h,l;
+
+ dint();
+ do
+   l=TA1R;
+   while (l!=TA1R);
+ h=instHigh;
+ // Overflow pending but not counted yet
+ if ((TA1CTL&TAIFG)&&(l<0x8000)) h++;
+ eint();
+
+ return ((((unsigned long)h)<<16)+l)<<ACLK_SHIFT;
+ }
+
+// Starts the counters of a frequency
+void instStart()
+ {
+ dint();
+ instGates=0;
+ instDisc=0;
+ eint();
+ instT0=instTime();
+ }
+
+// Stores the counters of frequency i after r repeated searches
+void instEnd(int i,int r)
+ {
+ Inst.ticks[i]=instTime()-instT0;
+ Inst.sets[i]=nsets;
+ Inst.gates[i]=instGates;
+ Inst.discarded[i]=instDisc;
+ Inst.retries[i]=r;
+
+ #ifdef TELEMETRY
+ txChar('P');
+ txNum(i);
+ txNum(nsets);
+ txNum(instGates);
+ txNum(instDisc);
+ txNum(r);
+ txNum(Inst.ticks[i]);
+ txEnd();
+ #endif
+ }
+
+// Sends the global counters
+#ifdef TELEMETRY
+void txGlobal()
+ {
+ txChar('G');
+ txNum(Inst.clk32Loops);
+ txNum(Inst.flashTicks);
+ txEnd();
+ }
+#endif
+
+#endif // INSTRUMENT
+
+// Sets the DCO near 1MHz
+// The ACLK divider is kept
+// Uses the factory 1MHz data if present, if not, the calibrated
+// frequency nearest to 1MHz or the reset default DCO (about 1.1MHz)
+void set1MHz()
+ {
+ if ((CALBC1_1MHZ!=0xFF)&&(CALDCO_1MHZ!=0xFF))
+     {
+	 dco_set(CALDCO_1MHZ,CALBC1_1MHZ);   // Cal. data for 1MHz
+     }
+    else if (SlowN)
+	 dco_set(SlowDCO,SlowBC1);
+    else
+	 dco_set(3*DCO0,XT2OFF+7);
+ }
+
 // Locks the system with an error code
 // Error code must be 1 or greater
 // The error is shown with a number of blinks
@@ -212,9 +1251,14 @@ void errorLock(int error)
  {
  int i;
 
- // Calibrated DCO data for 1MHz
- DCOCTL=CALDCO_1MHZ;    // DCOCTL   Cal. data for 1MHz
- BCSCTL1=CALBC1_1MHZ;   // BCSCTL1  Cal. data for 1MHz
+ // DCO near 1MHz
+ set1MHz();
+
+ #ifdef TELEMETRY
+ txChar('E');
+ txNum(error);
+ txEnd();
+ #endif
 
  while (1)
    {
@@ -234,8 +1278,12 @@ void errorLock(int error)
  }
 
 // One fast blink on green led
+// Skipped in TELEMETRY mode if TEL_BLINK is 0
 void ledBlink(unsigned char bits)
  {
+ #if defined(TELEMETRY) && (!TEL_BLINK)
+ return;
+ #endif
  SET_FLAG(P1OUT,bits);
  longDelay();
  RESET_FLAG(P1OUT,bits);
@@ -249,6 +1297,9 @@ void startClk32()
    {
 	BCSCTL3=XCAP_3; // Set 12.5pF
 	simpleDelay();
+    #ifdef INSTRUMENT
+	Inst.clk32Loops++;
+    #endif
    }
    while (BCSCTL3&LFXT1OF); // Loop while faulty
  }
@@ -256,9 +1307,9 @@ void startClk32()
 // Configure all the peripherals
 void configureAll()
  {
- // Calibrated DCO data for 1MHz
- DCOCTL=CALDCO_1MHZ;    // DCOCTL   Cal. data for 1MHz
- BCSCTL1=CALBC1_1MHZ;   // BCSCTL1  Cal. data for 1MHz
+ // DCO near 1MHz with the ACLK divider
+ SET_FLAG(BCSCTL1,BC1_DIVA);
+ set1MHz();
 
  // Set LEDs and F_OUT clk32/128 as output
  SET_FLAG(P1DIR,LED_RED+LED_GREEN+F_OUT+SMCLK_PIN);
@@ -276,6 +1327,14 @@ void configureAll()
  WDTCTL=WDT_ADLY_1_9;   // t=64/fACLK=1.9ms
  SET_FLAG(IE1,WDTIE);   // Enable WDT interrupt
 
+ // Timer1_A3 counts ACLK cycles for the instrumentation
+ // (divided ACLK in ACLK_CAPTURE mode, see instTime)
+ // TASSEL_1   Use ACLK
+ // MC_2       Mode Up Continuous
+ #ifdef INSTRUMENT
+ TA1CTL=TASSEL_1+ID_0+MC_2+TACLR+TAIE;
+ #endif
+
  // Configure the Timer A
 
  // TACTL
@@ -289,73 +1348,358 @@ void configureAll()
  // CCIE       Enable capture 0 interrupt
  // CM_3       Capture on both edges
  // CCIS_0     Capture on GND
+ #ifndef ACLK_CAPTURE
  TACCTL0=CAP+CCIE+CM_3+CCIS_2;
+ #else
+ // CM_1       Capture on rising edge
+ // CCIS_1     Capture on CCI0B (ACLK)
+ // SCS        Synchronous capture
+ // No interrupt, the Watchdog ISR reads the capture
+ TACCTL0=CAP+CM_1+CCIS_1+SCS;
+ #endif
 
  // Program P1.4 as SMCLK output
  SET_FLAG(P1SEL,SMCLK_PIN);
+
+ // UART telemetry
+ #ifdef TELEMETRY
+ txStart();
+ #endif
  }
 
-// Programs the DCO with
-// rsel: Range 0..15
-// dco:  Step 0..7
-// mod:  Modulation 0..31
-// Then lets the Oscilator work for several NCAP captures
-// to average the frequency measure.
-void setDCO(int rsel,int dco,int mod)
+#ifdef STRAP_SELECT
+
+// Reads the strap pin with the pull-up enabled
+// Selects the STRAP_MASK frequencies if it is grounded
+void readStrap()
  {
- // Set BSCTL1
- BCSCTL1=XT2OFF+rsel;
+ SET_FLAG(P1OUT,STRAP_PIN);   // Output "1" for Pull-Up
+ SET_FLAG(P1REN,STRAP_PIN);   // Resistor Enable
+ simpleDelay();
 
- // Set DCOCTL
- DCOCTL=dco*DCO0+mod;
+ if (!(P1IN&STRAP_PIN)) FreqMask=STRAP_MASK;
 
+ // Release the pin
+ RESET_FLAG(P1REN,STRAP_PIN);
+ RESET_FLAG(P1OUT,STRAP_PIN);
+ }
 
- // Loops for several captures
+#endif // STRAP_SELECT
+
+#ifdef TEMP_BINS
+
+// Reads the temperature sensor averaging TEMP_NREAD conversions
+// and selects the bin of the set to calibrate
+void readTemp()
+ {
+ int i;
+ unsigned long sum=0;
+
+ for(i=0;i<TEMP_NREAD;i++)
+	 sum+=ncal_temp_adc();
+
+ TempCode=(unsigned int)(sum/TEMP_NREAD);
+ tempBin=ncal_bin(TempCode);
+ }
+
+#endif // TEMP_BINS
+
+// Waits until there are n captures
+// In LOW_POWER_WAIT mode the CPU sleeps in LPM0
+// Interrupts are disabled to check ncap so the ISR cannot
+// end between the check and the sleep
+void waitCaptures(int n)
+ {
+ #ifdef LOW_POWER_WAIT
  dint();
- Mean=0;  // No captures yet
- ncap=-5; // 5 cycles before start averaging
+ ncapWake=n;
+ while (ncap<n)
+     {
+	 __bis_SR_register(LPM0_bits+GIE);
+	 dint();
+     }
  eint();
- while (ncap<NCAP) {};
- AveragedDifference=(unsigned int)(Mean/NCAP);
+ #else
+ while (ncap<n) {};
+ #endif
  }
 
-
-// Search for the indicated goal counter value
-// Returns 0 if the frequency is obtained
-// Returns 1 if cannot be obtained
-int searchGoal(unsigned int CurrentNGoal)
+// Waits for the next capture
+// Used in polling loops
+// In LOW_POWER_WAIT mode the CPU sleeps in LPM0
+void waitGate()
  {
- unsigned int prev;
- int m0diff;
+ #ifdef LOW_POWER_WAIT
+ dint();
+ ncapWake=-32767;  // Any capture wakes the CPU
+ __bis_SR_register(LPM0_bits+GIE);
+ #endif
+ }
 
- // Search RSEL ranges with central DCO and
- // no modulation
- for(rsel=0;rsel<16;rsel++)
-   {
-   // Set central DCOx
-   setDCO(rsel,3,0);
-   if (AveragedDifference>CurrentNGoal) break;
-   prev=AveragedDifference;
-   }
+#ifdef ADAPTIVE_NCAP
 
- if (rsel<16) // If we breaked...
+// Waits for the captures of a measurement
+// Ends when the standard error of the mean is below ADAPT_PPM
+// or after NCAP captures
+// The first capture is taken as the mean to compute the limit
+void adaptWait()
+ {
+ int n,s1,last=0;
+ unsigned long m,s2,ss,lim;
+ unsigned int t=0;
+
+ while (ncap<NCAP)
    {
-   if (rsel)  // and there is a previous rsel...
-	   //                and error was less before...
-      if ((CurrentNGoal-prev)<(AveragedDifference-CurrentNGoal))
-    	                                 rsel--;
+   // Check each time there is a new capture
+   waitCaptures(((last+1)>ADAPT_MIN)?(last+1):ADAPT_MIN);
+   if ((ncap<ADAPT_MIN)||(ncap==last)) continue;
+
+   dint();
+   n=ncap;
+   m=Mean;
+   s1=S1;
+   s2=S2;
+   eint();
+   if (n>=NCAP) break;
+   last=n;
+
+   // Limit of the standard error in 1/256 counts
+   if (!t) t=(unsigned int)(((unsigned long)RefDifference*ADAPT_PPM)/3906);
+
+   // Sum of squared deviations to the mean
+   ss=s2-((long)s1*s1)/n;
+
+   // The squared standard error ss/n^2 must be under the
+   // squared limit (t/256)^2. Compared in 1/256 units
+   if (ss>=0x800000L) continue;
+   lim=((unsigned long)t*n)>>4;
+   if ((ss<<8)<(lim*lim))
+       {
+	   dint();
+	   Mean=m;
+	   nmean=n;
+	   ncap=NCAP;
+	   eint();
+	   break;
+       }
    }
-  else
-   rsel=15;	 // If we don't breaked, limit rsel to 15
+ }
 
- // Now we have RSEL value so we search for DCO value
+#endif // ADAPTIVE_NCAP
 
- // Search DCO value
- for(dco=0;dco<8;dco++)
-    {
-	setDCO(rsel,dco,0);
-	if (AveragedDifference>CurrentNGoal) break;
-    }
+// Starts the average of the captures
+// discard: Number of captures before averaging
+// In SETTLE_DETECT mode this is the max number of captures
+void startMeasure(int discard)
+ {
+ dint();
+ Mean=0;         // No captures yet
+ ncap=-discard;  // Cycles before start averaging
+ #ifdef SETTLE_DETECT
+ settle=1;
+ ndisc=0;
+ #endif
+ #ifdef DECISION_MODE
+ nside=0;
+ #endif
+ #ifdef ADAPTIVE_NCAP
+ S1=0;
+ S2=0;
+ #endif
+ #ifdef VARIABLE_NCAP
+ nmean=NCAP;
+ #endif
+ eint();
+ }
+
+// Lets the Oscilator work for several NCAP captures
+// to average the frequency measure.
+void measureDCO()
+ {
+ // Loops for several captures
+ #ifdef SETTLE_DETECT
+ startMeasure(SETTLE_MAX);
+ #else
+ startMeasure(5); // 5 cycles before start averaging
+ #endif
+ #ifdef ADAPTIVE_NCAP
+ adaptWait();
+ #else
+ waitCaptures(NCAP);
+ #endif
+ #ifdef VARIABLE_NCAP
+ AveragedDifference=(unsigned int)(Mean/nmean);
+ #else
+ AveragedDifference=(unsigned int)(Mean/NCAP);
+ #endif
+ }
+
+#ifdef MEASURE_CACHE
+
+// Search the current DCO configuration in the cache
+// Returns 1 and sets AveragedDifference if found
+// Returns 0 if not found
+int cacheFind()
+ {
+ int i;
+
+ for(i=0;i<CACHE_SIZE;i++)
+	 if ((CacheBC1[i]==BCSCTL1)&&(CacheDCO[i]==DCOCTL))
+	     {
+		 // Check the age of the measure
+         #if CACHE_AGE
+		 if ((cacheTime-CacheTime[i])>=CACHE_AGE)
+			 return 0;
+         #endif
+		 AveragedDifference=CacheN[i];
+		 return 1;
+	     }
+
+ return 0;
+ }
+
+// Store the measure of the current DCO configuration
+// replacing the oldest entry
+void cacheStore()
+ {
+ CacheBC1[cacheNext]=BCSCTL1;
+ CacheDCO[cacheNext]=DCOCTL;
+ CacheN[cacheNext]=AveragedDifference;
+ CacheTime[cacheNext]=cacheTime;
+ cacheNext++;
+ if (cacheNext>=CACHE_SIZE) cacheNext=0;
+ }
+
+// Empties the cache
+void cacheClear()
+ {
+ int i;
+
+ for(i=0;i<CACHE_SIZE;i++)
+	 CacheBC1[i]=0;
+ cacheNext=0;
+ }
+
+// Drop the current DCO configuration from the cache
+void cacheDrop()
+ {
+ int i;
+
+ for(i=0;i<CACHE_SIZE;i++)
+	 if ((CacheBC1[i]==BCSCTL1)&&(CacheDCO[i]==DCOCTL))
+		 CacheBC1[i]=0;
+ }
+
+#endif // MEASURE_CACHE
+
+// Programs the DCO with
+// rsel: Range 0..15
+// dco:  Step 0..7
+// mod:  Modulation 0..31
+// Then measures its frequency
+// In MEASURE_CACHE mode recent measures are not repeated
+void setDCO(int rsel,int dco,int mod)
+ {
+ // Set BSCTL1
+ BCSCTL1=XT2OFF+BC1_DIVA+rsel;
+
+ // Set DCOCTL
+ DCOCTL=dco*DCO0+mod;
+
+ #ifdef MEASURE_CACHE
+ cached=cacheFind();
+ if (!cached)
+     {
+	 // Drop the previous entry if too old
+	 cacheDrop();
+	 measureDCO();
+	 cacheTime++;
+     #ifdef DECISION_MODE
+	 // Early decisions are not stored
+	 if (!DecisionGoal)
+     #endif
+		 cacheStore();
+     }
+ #else
+ measureDCO();
+ #endif
+
+ #ifdef DECISION_MODE
+ DecisionGoal=0;  // Next measurement is a full one
+ #endif
+
+ #if defined(TELEMETRY) || defined(INSTRUMENT)
+ nsets++;
+ #endif
+
+ #ifdef TELEMETRY
+ #if TRACE_SEARCH
+ txChar('T');
+ txNum(rsel);
+ txNum(dco);
+ txNum(mod);
+ txNum(AveragedDifference);
+ txEnd();
+ #endif
+ #endif
+ }
+
+// Programs the DCO as setDCO to compare with a goal
+// In DECISION_MODE the measurement ends as soon as it is
+// clearly over or under the goal
+#ifdef DECISION_MODE
+void probeDCO(int rsel,int dco,int mod,unsigned int goal)
+ {
+ DecisionGoal=goal;
+ DecisionMargin=goal>>DEC_SHIFT;
+ setDCO(rsel,dco,mod);
+ }
+#else
+#define probeDCO(RSEL,DCO,MOD,GOAL) setDCO(RSEL,DCO,MOD)
+#endif
+
+
+#ifndef BINARY_SEARCH
+
+// Search for the indicated goal counter value
+// Returns 0 if the frequency is obtained
+// Returns 1 if cannot be obtained
+int searchGoal(unsigned int CurrentNGoal)
+ {
+ unsigned int prev;
+ int m0diff;
+
+ // Search RSEL ranges with central DCO and
+ // no modulation
+ // Start one below the first RSEL so that prev is measured
+ rsel=FIRST_RSEL;
+ if (rsel) rsel--;
+ for(;rsel<16;rsel++)
+   {
+   // Set central DCOx
+   probeDCO(rsel,3,0,CurrentNGoal);
+   if (AveragedDifference>CurrentNGoal) break;
+   prev=AveragedDifference;
+   }
+
+ if (rsel<16) // If we breaked...
+   {
+   if (rsel)  // and there is a previous rsel...
+	   //                and error was less before...
+      if ((CurrentNGoal-prev)<(AveragedDifference-CurrentNGoal))
+    	                                 rsel--;
+   }
+  else
+   rsel=15;	 // If we don't breaked, limit rsel to 15
+
+ // Now we have RSEL value so we search for DCO value
+
+ // Search DCO value
+ for(dco=FIRST_DCO;dco<8;dco++)
+    {
+	probeDCO(rsel,dco,0,CurrentNGoal);
+	if (AveragedDifference>CurrentNGoal) break;
+    }
 
  // If we did not break cannot modulate
  if (dco>7) return 1;
@@ -374,7 +1718,7 @@ int searchGoal(unsigned int CurrentNGoal)
  // Search MOD value
  for(mod=0;mod<32;mod++)
     {
- 	setDCO(rsel,dco,mod);
+ 	probeDCO(rsel,dco,mod,CurrentNGoal);
  	if (AveragedDifference>CurrentNGoal) break;
  	prev=AveragedDifference;
     }
@@ -406,18 +1750,723 @@ int searchGoal(unsigned int CurrentNGoal)
  return 0;
  }
 
+#else // BINARY_SEARCH
+
+// Search for the indicated goal counter value
+// using successive approximation
+// As frequency rises with RSEL, DCO and MOD, for each one
+// we bisect to find the first value over the goal.
+// At the end of each bisection lo is the last value
+// at or below the goal and hi the first value over the goal
+// Returns 0 if the frequency is obtained
+// Returns 1 if cannot be obtained
+int searchGoal(unsigned int CurrentNGoal)
+ {
+ int lo,lo0,hi,mid;
+ unsigned int nlo,nhi;
+ unsigned int m0diff;
+
+ // Search RSEL ranges with central DCO and
+ // no modulation
+ lo0=lo=FIRST_RSEL-1;
+ hi=16;
+ nlo=nhi=0;
+ while ((hi-lo)>1)
+   {
+   mid=(lo+hi)/2;
+   probeDCO(mid,3,0,CurrentNGoal);
+   if (AveragedDifference>CurrentNGoal)
+       { hi=mid; nhi=AveragedDifference; }
+      else
+       { lo=mid; nlo=AveragedDifference; }
+   }
+
+ if (hi<16)  // If some rsel is over goal...
+   {
+   // The lower bound is not measured if bisection never moved it
+   if ((lo==lo0)&&(lo>=0))
+       {
+       probeDCO(lo,3,0,CurrentNGoal);
+       nlo=AveragedDifference;
+       }
+   rsel=hi;
+   if (lo>=0)  // and there is a previous rsel...
+	   //                and error was less before...
+      if ((CurrentNGoal-nlo)<(nhi-CurrentNGoal))
+    	                                 rsel=lo;
+   }
+  else
+   rsel=15;	 // If none is over goal, limit rsel to 15
+
+ // Now we have RSEL value so we search for DCO value
+ lo=FIRST_DCO-1;
+ hi=8;
+ while ((hi-lo)>1)
+   {
+   mid=(lo+hi)/2;
+   probeDCO(rsel,mid,0,CurrentNGoal);
+   if (AveragedDifference>CurrentNGoal)
+       { hi=mid; nhi=AveragedDifference; }
+      else
+       lo=mid;
+   }
+
+ // If no dco is over goal we cannot modulate
+ if (hi>7) return 1;
+
+ // If dco=0 we cannot modulate also
+ if (!hi) return 1;
+
+ // Backup value of last error before MOD modulation
+ m0diff=nhi-CurrentNGoal;
+
+ // Now we have DCO value we then search for MOD value
+
+ // Take base freq less than over goal
+ dco=hi-1;
+
+ // Search MOD value
+ lo=-1;
+ hi=32;
+ while ((hi-lo)>1)
+   {
+   mid=(lo+hi)/2;
+   probeDCO(rsel,dco,mid,CurrentNGoal);
+   if (AveragedDifference>CurrentNGoal)
+       { hi=mid; nhi=AveragedDifference; }
+      else
+       { lo=mid; nlo=AveragedDifference; }
+   }
+
+ if (hi<32)  // If some mod is over goal
+  {
+  mod=hi;
+  if (lo>=0) // If there is a lower mod...
+	 // If lower mod got less error...
+	 if ((nhi-CurrentNGoal)>(CurrentNGoal-nlo))
+		       mod=lo;
+  }
+ else     // If none is over goal...
+  {
+  mod=31; // Limit for mod
+  }
+
+ // Check special case
+ // MOD 31 is compared with the next DCO without modulation
+ if (mod==31)
+   {
+   if (hi<32) nlo=nhi;  // Measure at MOD 31
+   if (m0diff<((nlo>CurrentNGoal)?(nlo-CurrentNGoal):(CurrentNGoal-nlo)))
+           {
+ 	      dco++;
+ 	      mod=0;
+           }
+   }
+
+ // Set final DCO configuration
+ setDCO(rsel,dco,mod);
+
+ return 0;
+ }
+
+#endif // BINARY_SEARCH
+
+#ifdef LOCAL_SEARCH
+
+// Programs the DCO with RSEL and a DCOCTL position
+// to compare with a goal
+// x: DCOCTL value (dco*32+mod) 0..224
+void probeDCOpos(int x,unsigned int goal)
+ {
+ probeDCO(rsel,x>>5,x&0x1F,goal);
+ }
+
+// Search for the indicated goal counter value
+// around a DCOCTL position x for the current rsel
+// The step is doubled until the goal is crossed and then
+// the crossing is bisected.
+// Returns 0 if the frequency is obtained
+// Returns 1 if the goal is not in the neighbourhood
+// of range DCOCTL steps
+// Returns 2 if the goal is under DCOCTL 0, or 3 if it is
+// over DCOCTL 224, of the current rsel inside the neighbourhood
+int refineGoal(unsigned int CurrentNGoal,int x,int range)
+ {
+ int lo,hi,mid,step;
+ unsigned int nlo,nhi;
+
+ // Measure the seed
+ probeDCOpos(x,CurrentNGoal);
+
+ step=1;
+ if (AveragedDifference>CurrentNGoal)
+     {
+	 // Seed is over goal, go down
+	 hi=x;
+	 nhi=AveragedDifference;
+	 do
+	   {
+	   lo=x-step;
+	   if (step>range) return 1;
+	   if (lo<0)
+	       {
+	       if (!hi) return 2;
+	       lo=0;
+	       }
+	   probeDCOpos(lo,CurrentNGoal);
+	   if (AveragedDifference<=CurrentNGoal) break;
+	   hi=lo;
+	   nhi=AveragedDifference;
+	   step*=2;
+	   }
+	   while (1);
+	 nlo=AveragedDifference;
+     }
+    else
+     {
+     // Seed is at or below goal, go up
+     lo=x;
+     nlo=AveragedDifference;
+     do
+       {
+       hi=x+step;
+       if (step>range) return 1;
+       if (hi>224)
+           {
+           if (lo==224) return 3;
+           hi=224;
+           }
+       probeDCOpos(hi,CurrentNGoal);
+       if (AveragedDifference>CurrentNGoal) break;
+       lo=hi;
+       nlo=AveragedDifference;
+       step*=2;
+       }
+       while (1);
+     nhi=AveragedDifference;
+     }
+
+ // Bisect between lo (at or below goal) and hi (over goal)
+ while ((hi-lo)>1)
+   {
+   mid=(lo+hi)/2;
+   probeDCOpos(mid,CurrentNGoal);
+   if (AveragedDifference>CurrentNGoal)
+       { hi=mid; nhi=AveragedDifference; }
+      else
+       { lo=mid; nlo=AveragedDifference; }
+   }
+
+ // Take the one with less error
+ if ((nhi-CurrentNGoal)>(CurrentNGoal-nlo))
+	 x=lo;
+    else
+     x=hi;
+
+ dco=x>>5;
+ mod=x&0x1F;
+
+ // Set final DCO configuration
+ setDCO(rsel,dco,mod);
+
+ return 0;
+ }
+
+#endif // LOCAL_SEARCH
+
+#ifdef FACTORY_SEED
+
+// Search for the goal of frequency i starting at
+// the factory calibration seed
+// Returns 0 if the frequency is obtained
+// Returns 1 if there is no factory data or the goal is
+// far from the seed, so a normal search is needed
+int seedSearch(int i)
+ {
+ unsigned char *pA,*pB;
+ int ga,gb,g,r;
+
+ #ifdef INSTRUMENT
+ Inst.seeds++;
+ #endif
+
+ pA=(unsigned char *) SeedA[i];
+ pB=(unsigned char *) SeedB[i];
+
+ // Check for factory data
+ if ((pA[1]==0xFF)||(SeedW[i]&&(pB[1]==0xFF))) return 1;
+
+ if (SeedW[i])
+     {
+	 // Interpolate using SEED_RSTEP DCOCTL steps for each RSEL step
+	 // DCOCTL can go over SEED_RSTEP only in RSEL 15
+	 ga=(pA[1]&0x0F)*SEED_RSTEP+pA[0];
+	 gb=(pB[1]&0x0F)*SEED_RSTEP+pB[0];
+	 g=ga+(int)(((long)(gb-ga)*SeedW[i])/256);
+	 if ((g<0)||(g>(15*SEED_RSTEP+224))) return 1;
+	 rsel=g/SEED_RSTEP;
+	 if (rsel>15) rsel=15;
+	 g-=rsel*SEED_RSTEP;
+     }
+    else
+     {
+     // Use the factory data as is
+     rsel=pA[1]&0x0F;
+     g=pA[0];
+     }
+
+ r=refineGoal(GoalN[i],g,SEED_RANGE);
+
+ // Go on in the next RSEL from the same frequency
+ // DCOCTL 0 is near SEED_RSTEP of the RSEL under it
+ if ((r==2)&&(rsel>0))
+     {
+	 rsel--;
+	 r=refineGoal(GoalN[i],SEED_RSTEP,SEED_RANGE);
+     }
+ if ((r==3)&&(rsel<15))
+     {
+	 rsel++;
+	 r=refineGoal(GoalN[i],224-SEED_RSTEP,SEED_RANGE);
+     }
+
+ #ifdef INSTRUMENT
+ if (!r) Inst.seedHits++;
+ #endif
+
+ return r;
+ }
+
+#endif // FACTORY_SEED
+
+#ifdef CHAR_SWEEP
+
+// Quick measure of the DCO for the characterisation sweep
+// Only CHAR_NCAP captures are averaged
+// Returns the averaged difference
+unsigned int quickDCO(int rsel,int dco,int mod)
+ {
+ int n;
+ unsigned long m;
+
+ BCSCTL1=XT2OFF+BC1_DIVA+rsel;
+ DCOCTL=dco*DCO0+mod;
+
+ startMeasure(CHAR_SETTLE);
+ waitCaptures(CHAR_NCAP);
+
+ // End the measure
+ dint();
+ n=ncap;
+ m=Mean;
+ ncap=NCAP;
+ eint();
+
+ return (unsigned int)(m/n);
+ }
+
+// Obtains the DCO and MOD values for frequency i
+// from the sweep data of one RSEL range
+// Stores them in CalDCO and CalBC1
+// CalBC1 is 0xFF if the frequency cannot be obtained
+void charTarget(int i,int r)
+ {
+ int d,m;
+ unsigned int goal,n0,n1,n31;
+
+ goal=GoalN[i];
+
+ // Measure all the DCO steps if needed
+ if (RowRsel!=r)
+     {
+	 for(d=0;d<8;d++)
+		 Row[d]=quickDCO(r,d,0);
+	 RowRsel=r;
+     }
+
+ // Search first DCO over goal
+ for(d=0;d<8;d++)
+	 if (Row[d]>goal) break;
+
+ // We need a lower DCO to modulate
+ if ((d>7)||(!d))
+     {
+	 CalBC1[i]=0xFF;
+	 return;
+     }
+
+ // Interpolate MOD between lower and upper DCO
+ // Modulation mixes the periods of both DCO values
+ // so MOD=32*n1*(goal-n0)/(goal*(n1-n0))
+ n0=Row[d-1];
+ n1=Row[d];
+ m=(int)(((((unsigned long)(goal-n0)*n1)/goal)*32+(n1-n0)/2)/(n1-n0));
+
+ if (m>=32)
+     {
+	 // Next DCO without modulation
+	 CalDCO[i]=d*DCO0;
+     }
+    else
+     {
+     CalDCO[i]=(d-1)*DCO0+m;
+
+     // Check MOD 31 end point against next DCO
+     if (m==31)
+         {
+    	 n31=quickDCO(r,d-1,31);
+    	 if (n31>goal) n31-=goal; else n31=goal-n31;
+    	 if ((n1-goal)<n31) CalDCO[i]=d*DCO0;
+         }
+     }
+
+ CalBC1[i]=XT2OFF+r;
+ }
+
+// Characterisation sweep
+// Obtains the DCO configuration for all frequencies
+// The RSEL range is selected as in searchGoal
+// measuring the central DCO of each RSEL
+void charSweep()
+ {
+ int i,r,left;
+ unsigned int n3,prev3=0;
+
+ // No frequency found yet
+ // Not selected ones are out of the sweep
+ left=0;
+ for(i=0;i<NFREQ;i++)
+	 if (FreqMask&(1UL<<i))
+	     {
+		 CalBC1[i]=0;
+		 left++;
+	     }
+	    else
+		 CalBC1[i]=0xFF;
+
+ for(r=0;(r<16)&&left;r++)
+    {
+	n3=quickDCO(r,3,0);
+
+	for(i=0;i<NFREQ;i++)
+		if ((!CalBC1[i])&&((n3>GoalN[i])||(r==15)))
+		    {
+			// Take previous range if it gives less error
+			if ((r)&&(n3>GoalN[i])&&((GoalN[i]-prev3)<(n3-GoalN[i])))
+				charTarget(i,r-1);
+			   else
+				charTarget(i,r);
+			left--;
+		    }
+
+	prev3=n3;
+    }
+ }
+
+// Sets the DCO configuration found in the sweep for frequency i
+// and measures it
+// Returns 0 if the configuration is set
+// Returns 1 if the sweep did not find it
+int charCheck(int i)
+ {
+ if (CalBC1[i]==0xFF) return 1;
+
+ rsel=CalBC1[i]&0x0F;
+ dco=CalDCO[i]>>5;
+ mod=CalDCO[i]&0x1F;
+ setDCO(rsel,dco,mod);
+
+ return 0;
+ }
+
+#endif // CHAR_SWEEP
+
+#ifdef LONG_GATE
+
+// Measures the current DCO with one long gate
+// The first gate after the change is discarded
+// Returns the DCO cycles in LONG_CYCLES ACLK cycles
+unsigned long longMeasure()
+ {
+ // Count Timer A overflows
+ TarHigh=0;
+ SET_FLAG(TACTL,TAIE);
+
+ // Set the long gate
+ dint();
+ WDTCTL=LONG_WDT;
+ longGate=1;
+ ncap=-1;
+ eint();
+
+ // Wait for the two captures
+ waitCaptures(1);
+
+ // Return to the normal gate
+ dint();
+ longGate=0;
+ WDTCTL=WDT_ADLY_1_9;
+ RESET_FLAG(TACTL,TAIE);
+ eint();
+
+ return LongDifference;
+ }
+
+// Measures the error of frequency i with a long gate
+// Returns the error in ppm
+long int longError(int i)
+ {
+ long long expected;
+
+ // Expected DCO cycles in LONG_CYCLES ACLK cycles
+ // are freq(Hz)*LONG_CYCLES/32768
+ expected=(long long)FreqHz[i]*LONG_CYCLES;
+
+ return (long int)((((long long)longMeasure()*32768-expected)*1000000)/expected);
+ }
+
+#endif // LONG_GATE
+
+#ifdef APPEND_RECORDS
+
+// Finds the newest valid calibration record
+// Sets Record and recPos, Record is 0 if there is none
+void recFind()
+ {
+ recPos=ncal_record();
+ Record=(recPos<0)?0:(uint16_t *) NCAL_REC_POS(recPos);
+ }
+
+// Test if record slot k is blank
+int recBlank(int k)
+ {
+ int i;
+ uint16_t *p;
+
+ p=(uint16_t *) NCAL_REC_POS(k);
+ for(i=0;i<NCAL_REC_WORDS;i++)
+	 if (p[i]!=0xFFFF) return 0;
+
+ return 1;
+ }
+
+// Finds the slot for a new record after the newest one
+// Partially written slots are skipped
+// If the record must start a segment that is not blank,
+// flashErase is set to erase it first
+// Returns the slot
+int recFree()
+ {
+ int k,n;
+
+ flashErase=0;
+ k=recPos;
+ for(n=0;n<NCAL_REC_SLOTS;n++)
+     {
+	 k++;
+	 if (k>=NCAL_REC_SLOTS) k=0;
+	 if (recBlank(k)) break;
+
+	 // Current segment is full
+	 if (!(k%NCAL_REC_PER_SEG))
+	     {
+		 flashErase=1;
+		 break;
+	     }
+     }
+
+ return k;
+ }
+
+// Returns the stored DCOCTL,BCSCTL1 pair of
+// frequency i in the newest record
+unsigned char *calPtr(int i)
+ {
+ if (!Record) return (unsigned char *) &NoData;
+ return (unsigned char *) (Record+NCAL_REC_DATA+i);
+ }
+
+#else
+
+// Test if section B (or the segment of the bin) is blank
+int segBlank()
+ {
+ uint16_t *p;
+
+ for(p=(uint16_t *) (NCAL_HEAD_-BIN_OFS);p<=(uint16_t *) (NCAL_TOP_-BIN_OFS);p++)
+	 if (*p!=0xFFFF) return 0;
+
+ return 1;
+ }
+
+// Stored DCOCTL,BCSCTL1 pair of frequency i
+#define calPtr(i) (calValid?(unsigned char *) (CalPos[i]-BIN_OFS):(unsigned char *) &NoData)
+
+#endif // APPEND_RECORDS
+
+#ifdef DRIFT_CORRECT
+
+// Corrects the drift of frequency i in loop frequency mode
+// DRIFT_NCAP captures are averaged and DCOCTL is moved one
+// step if the error is over goal/2^DRIFT_SHIFT
+// MOD is not used with DCO 7, so DCOCTL stays under 0xE0
+void driftCorrect(int i)
+ {
+ int n;
+ unsigned long m,goal,margin;
+
+ // Discard the capture in progress
+ startMeasure(1);
+ waitCaptures(DRIFT_NCAP);
+
+ // End the measure
+ dint();
+ n=ncap;
+ m=Mean;
+ ncap=NCAP;
+ eint();
+
+ // The sum of the captures is compared so the average is not
+ // truncated, a count is 0.1% at 500kHz
+ goal=(unsigned long)GoalN[i]*n;
+ margin=goal>>DRIFT_SHIFT;
+
+ if ((m>(goal+margin))&&(DCOCTL>0)) DCOCTL--;
+ if ((m<(goal-margin))&&(DCOCTL<0xE0)) DCOCTL++;
+ }
+
+#endif // DRIFT_CORRECT
+
+// Test if frequency i has no calibration data
+// If flash is true, it checks flash data
+// If not, it checks RAM data
+int calEmpty(int flash,int i)
+ {
+ if (flash) return (calPtr(i)[1]==0xFF);
+ return (CalBC1[i]==0xFF);
+ }
+
+// Test if any frequency has calibration data
+// If flash is true, it checks flash data
+// If not, it checks RAM data
+int calAny(int flash)
+ {
+ int i;
+
+ for(i=0;i<NFREQ;i++)
+	 if (!calEmpty(flash,i)) return 1;
+ return 0;
+ }
+
+#if defined(VERIFY_MODE) || defined(COMMAND_MODE)
+
+// Measures the stored data of frequency i
+// Only VERIFY_NCAP captures are averaged
+// Returns the averaged difference
+unsigned int verifyCount(int i)
+ {
+ int n;
+ unsigned long m;
+ unsigned char *ptr;
+
+ // Set the frequency from flash
+ ptr=calPtr(i);
+ dco_set(ptr[0],ptr[1]);
+
+ startMeasure(VERIFY_SETTLE);
+ waitCaptures(VERIFY_NCAP);
+
+ // End the measure
+ dint();
+ n=ncap;
+ m=Mean;
+ ncap=NCAP;
+ eint();
+
+ return (unsigned int)(m/n);
+ }
+
+#endif
+
+#ifdef VERIFY_MODE
+
+// Measures the stored data of frequency i
+// Returns the frequency error in %
+int verifyError(int i)
+ {
+ unsigned int diff;
+
+ diff=verifyCount(i);
+ return (int)((100*((long int)diff-(long int)GoalN[i]))/GoalN[i]);
+ }
+
+// Verifies the stored data of the selected frequencies
+// Frequencies inside the MAX_ERROR tolerance are deselected
+// so only the failing ones are calibrated again
+// Blinks the red led once for each failing frequency
+// Returns the number of failing frequencies
+int verifyFlash()
+ {
+ int i,error,fail=0;
+
+ for(i=0;i<NFREQ;i++)
+     {
+	 if (!(FreqMask&(1UL<<i))) continue;
+
+	 // Frequencies without data are calibrated
+	 if (!calEmpty(1,i))
+	     {
+		 error=verifyError(i);
+		 if ((error<=MAX_ERROR)&&(error>=(-MAX_ERROR)))
+		     {
+			 FreqMask&=~(1UL<<i);
+			 continue;
+		     }
+	     }
+	 fail++;
+     }
+
+ // Return to DCO near 1MHz
+ set1MHz();
+
+ // Show the number of failing frequencies
+ for(i=0;i<fail;i++)
+     {
+	 ledBlink(LED_RED);
+	 longDelay();
+     }
+
+ return fail;
+ }
+
+#endif // VERIFY_MODE
+
 // Test if the flash to program in section B is empty
+// Only the selected frequencies are checked
 // If the zone has any data, return 1
 // If the zone is empty, return 0
+// Data without a valid header is not used and, as data
+// with a header, is erased before writing
 int testFlashEmpty()
  {
  int i;
  unsigned char *ptr;
 
- // Check every frequency cal location
+ #ifndef APPEND_RECORDS
+ if (calValid)
+	 flashErase=1;
+    else
+     {
+	 if (!segBlank()) flashErase=1;
+	 return 0;
+     }
+ #endif
+
+ // Check every selected frequency cal location
  for(i=0;i<NFREQ;i++)
      {
-	 ptr=(unsigned char *) CalPos[i];
+	 if (!(FreqMask&(1UL<<i))) continue;
+	 ptr=calPtr(i);
 	 if ((*(ptr++))!=0xFF) return 1;  // Check DCOCTL
 	 if (*ptr!=0xFF) return 1;        // Check BCSCTL1
      }
@@ -425,174 +2474,705 @@ int testFlashEmpty()
  return 0;
  }
 
+// Flash timing generator divider for the fastest calibrated frequency
+// The divider gives the highest fTG not over FTG_MAX
+// Returns 0 if fTG cannot be inside the allowed range
+unsigned int flashDivider()
+ {
+ unsigned long f;
+ unsigned int div;
+
+ if (!FlashN) return 0;
+
+ // Frequency in Hz
+ f=((unsigned long)FlashN*32768)/GATE_CYCLES;
+
+ div=(unsigned int)((f+FTG_MAX-1)/FTG_MAX);
+ if ((div>64)||((f/div)<FTG_MIN)) return 0;
+
+ return div;
+ }
+
+// Sets the DCO and the flash timing generator for a flash operation
+// div is the flashDivider result, if 0 the factory 1MHz data is used
+void flashClock(unsigned int div)
+ {
+ if (div)
+     {
+	 // Set the fastest calibrated frequency
+	 dco_set(FlashDCO,FlashBC1);
+
+	 // Flash freq. is MCLK/div
+	 FCTL2 = FWKEY + FSSEL_1 + (div-1);
+     }
+    else
+     {
+	 // Set calibrated DCO data for 1MHz
+	 dco_set(CALDCO_1MHZ,CALBC1_1MHZ);   // Cal. data for 1MHz
+
+	 // Set Flash freq. as 333kHz
+	 // It's supposed that MCLK is 1MHz
+	 // Divider is 3
+	 FCTL2 = FWKEY + FSSEL_1 + FN1;
+     }
+ }
+
+#ifdef FLASH_BLOCK
+
+// Block writes n words at pFlash
+// Placed in RAM as the flash cannot be read during a block write
+// so only registers and RAM data are used
+__attribute__((section(".data")))
+void flashBlock(uint16_t *pFlash,uint16_t *words,int n)
+ {
+ FCTL1 = FWKEY + BLKWRT + WRT;
+ while (n--)
+     {
+	 *(pFlash++)=*(words++);
+	 while (!(FCTL3&WAIT));  // Wait for the word write
+     }
+ FCTL1 = FWKEY;                // End the block write
+ while (FCTL3&BUSY);
+ }
+
+#endif // FLASH_BLOCK
+
+#ifdef REBUILD_SEGA
+
+// Rebuilds the factory DCO data in Segment A if it is blank
+// Writes the 1, 8, 12 and 16MHz calibrations, the TLV tag
+// and the Segment A checksum
+// Called from flashWrite with the flash unlocked
+void segAWrite()
+ {
+ uint16_t *p;
+ unsigned int sum=0;
+
+ // Only if all the calibrations are found
+ if ((CalBC1[NCAL_IDX_1MHZ]==0xFF)||(CalBC1[NCAL_IDX_8MHZ]==0xFF)
+	||(CalBC1[NCAL_IDX_12MHZ]==0xFF)||(CalBC1[NCAL_IDX_16MHZ]==0xFF))
+	 return;
+
+ // Only if all Segment A is blank
+ for(p=(uint16_t *) 0x10C0;p<(uint16_t *) 0x1100;p++)
+	 if (*p!=0xFFFF) return;
+
+ // Unlock Segment A (LOCKA toggles)
+ if (FCTL3&LOCKA) FCTL3=FWKEY+LOCKA;
+
+ FCTL1 = FWKEY + WRT;
+
+ // DCO TLV with 8 bytes of data
+ *((uint16_t *) (CALDCO_16MHZ_-2))=TAG_DCO_30+8*256;
+ *((uint16_t *) CALDCO_16MHZ_)=CalDCO[NCAL_IDX_16MHZ]+(CalBC1[NCAL_IDX_16MHZ]<<8);
+ *((uint16_t *) CALDCO_12MHZ_)=CalDCO[NCAL_IDX_12MHZ]+(CalBC1[NCAL_IDX_12MHZ]<<8);
+ *((uint16_t *) CALDCO_8MHZ_) =CalDCO[NCAL_IDX_8MHZ] +(CalBC1[NCAL_IDX_8MHZ]<<8);
+ *((uint16_t *) CALDCO_1MHZ_) =CalDCO[NCAL_IDX_1MHZ] +(CalBC1[NCAL_IDX_1MHZ]<<8);
+
+ // Checksum is the two's complement of the XOR of the rest
+ for(p=(uint16_t *) 0x10C2;p<(uint16_t *) 0x1100;p++)
+	 sum^=*p;
+ *((uint16_t *) 0x10C0)=-sum;
+
+ FCTL1 = FWKEY;
+
+ // Lock Segment A again
+ FCTL3=FWKEY+LOCKA;
+ }
+
+#endif // REBUILD_SEGA
+
 // Writes the calibration data found to flash
 // information area in section B
+// Only the selected frequencies are written unless the
+// segment is erased, then the old data of the rest is restored
 void flashWrite()
  {
  int i;
- unsigned char *pFlash;
+ unsigned int div;
+ uint16_t *pFlash;
+ #ifdef INSTRUMENT
+ unsigned long t0;
+ #endif
+ #ifdef APPEND_RECORDS
+ int k;
+ unsigned long set=0;
+ uint16_t words[NCAL_REC_WORDS];
+ #else
+ uint16_t words[NFREQ];
+ uint16_t head[2];
+ #endif
+
+ // Start of the write
+ #ifdef INSTRUMENT
+ t0=instTime();
+ #endif
 
  // Flash Timing
+ div=flashDivider();
 
  // Test for 1MHz calibration data
- // as we need known DCO frequency for flash timing.
- if (CALBC1_1MHZ ==0xFF || CALDCO_1MHZ == 0xFF)
+ // as we need known DCO frequency for flash timing
+ // if no calibrated frequency can be used
+ if ((!div)&&(CALBC1_1MHZ ==0xFF || CALDCO_1MHZ == 0xFF))
 	    errorLock(4);
 
- dint(); // Disable interrupts in flash operation
+ #ifdef APPEND_RECORDS
+ // New record after the newest one
+ // Not selected frequencies have the old data
+ k=recFree();
+ pFlash=(uint16_t *) NCAL_REC_POS(k);
+ words[0]=NCAL_REC_HEAD;
+ for(i=0;i<NFREQ;i++)
+     {
+	 words[NCAL_REC_DATA+i]=CalDCO[i]+(CalBC1[i]<<8);
+	 if (CalBC1[i]!=0xFF) set|=1UL<<i;
+     }
+ words[1]=(uint16_t)set;
+ words[2]=(uint16_t)(set>>16);
+ words[3]=Record?(Record[3]+1):0;
+ words[NCAL_REC_WORDS-1]=ncal_crc16(words,NCAL_REC_WORDS-1);
+ #else
+ // Segment position to erase
+ pFlash = (uint16_t *) (NCAL_TOP_-BIN_OFS);
+
+ // Calibration words from the lowest position
+ // Not selected frequencies have the old data
+ for(i=0;i<NFREQ;i++)
+	  words[(CalPos[i]-NCAL_LOW_)/2]=CalDCO[i]+(CalBC1[i]<<8);
 
- // Set calibrated DCO data for 1MHz
- DCOCTL=CALDCO_1MHZ;    // DCOCTL   Cal. data for 1MHz
- BCSCTL1=CALBC1_1MHZ;   // BCSCTL1  Cal. data for 1MHz
+ // Header to write after the data
+ head[0]=NCAL_HEAD;
+ head[1]=ncal_crc16(words,NFREQ);
+ #endif
 
- // Set Flash freq. as 333kHz
- // It's supposed that MCLK is 1MHz
- // Divider is 3
- FCTL2 = FWKEY + FSSEL_1 + FN1;
+ dint(); // Disable interrupts in flash operation
+
+ // Flash timing generator clock
+ flashClock(div);
 
  // Unlock the flash
  FCTL3=FWKEY;
 
- // We only need to erase if override
- #ifdef FLASH_OVERRIDE
+ // We only need to erase if override or verify fails
+ // or if the record starts a full segment
+ if (flashErase)
+   {
    // Erase individual segment only
    FCTL1 = FWKEY + ERASE;
 
-   // Dummy Write
-   pFlash = (unsigned char *) CalPos[0];
-  (*pFlash)=0;
- #endif
+   // Dummy Write
+  (*pFlash)=0;
+   }
+
+ #ifdef APPEND_RECORDS
+   #ifdef FLASH_BLOCK
+   // Write the record in one block
+   flashBlock(pFlash,words,NCAL_REC_WORDS);
+   #else
+   // Write the record, the CRC is the last word
+   FCTL1 = FWKEY + WRT;
+   for(i=0;i<NCAL_REC_WORDS;i++)
+	   pFlash[i]=words[i];
+   FCTL1 = FWKEY; // Clear WRT bit
+   #endif
+ #elif defined(FLASH_BLOCK)
+ // Write all calibration data in one block
+ // and then the header
+ flashBlock((uint16_t *) (NCAL_LOW_-BIN_OFS),words,NFREQ);
+ flashBlock((uint16_t *) (NCAL_HEAD_-BIN_OFS),head,2);
+ #else
+ // Set write mode
+ FCTL1 = FWKEY + WRT;
+
+ // Write calibration data
+ // DCOCTL and BCSCTL1 in one word
+ for(i=0;i<NFREQ;i++)
+      {
+	  if ((!flashErase)&&(!(FreqMask&(1UL<<i)))) continue;
+	  pFlash = (uint16_t *) (CalPos[i]-BIN_OFS);
+	  (*pFlash)=CalDCO[i]+(CalBC1[i]<<8);
+      }
+
+ // Header is written last
+ pFlash = (uint16_t *) (NCAL_HEAD_-BIN_OFS);
+ pFlash[0]=head[0];
+ pFlash[1]=head[1];
+
+ // End flash operation
+ FCTL1 = FWKEY; // Clear WRT bit
+ #endif
+ // Factory data
+ #ifdef REBUILD_SEGA
+ segAWrite();
+ #endif
+
+ FCTL3 = FWKEY + LOCK; // Set LOCK bit
+
+ // Return to DCO near 1MHz
+ set1MHz();
+
+ eint(); // Enable interrupts
+
+ #ifdef INSTRUMENT
+ Inst.flashTicks=instTime()-t0;
+ #endif
+
+ // The new record is now the newest one
+ #ifdef APPEND_RECORDS
+ Record=pFlash;
+ recPos=k;
+ #else
+ calValid=1;
+ #endif
+ }
+
+#ifdef MAP_BUILD
+
+// Measures a DCO point with MOD 0
+// Returns its frequency in Hz
+unsigned long mapHz(int rsel,int dco)
+ {
+ int n;
+ unsigned long m;
+
+ dco_set(dco*DCO0,XT2OFF+rsel);
+
+ startMeasure(MAP_SETTLE);
+ waitCaptures(MAP_NCAP);
+
+ // End the measure
+ dint();
+ n=ncap;
+ m=Mean;
+ ncap=NCAP;
+ eint();
+
+ // Counts of each gate fit in 16 bits so this does not overflow
+ return (m*(32768UL/GATE_CYCLES))/n;
+ }
+
+// Writes the dense DCO map to Segments D and C
+// words has the first value and the differences
+void mapWrite(uint16_t *words)
+ {
+ int i;
+ unsigned int div;
+ uint16_t *pFlash = (uint16_t *) NCAL_MAP_;
+
+ // Flash Timing as in flashWrite
+ div=flashDivider();
+ if ((!div)&&(CALBC1_1MHZ ==0xFF || CALDCO_1MHZ == 0xFF))
+	    errorLock(4);
+
+ dint(); // Disable interrupts in flash operation
+
+ flashClock(div);
+ FCTL3=FWKEY;
+
+ // Erase Segments D and C
+ FCTL1 = FWKEY + ERASE;
+ pFlash[0]=0;
+ FCTL1 = FWKEY + ERASE;
+ pFlash[32]=0;
 
- // Set write mode
+ // Map data and then the header
  FCTL1 = FWKEY + WRT;
+ for(i=0;i<NCAL_MAP_WORDS;i++)
+	 pFlash[2+i]=words[i];
+ pFlash[1]=ncal_crc16(words,NCAL_MAP_WORDS);
+ pFlash[0]=NCAL_MAP_HEAD;
 
- // Write calibration data
- for(i=0;i<NFREQ;i++)
-      {
-	  pFlash = (unsigned char *) CalPos[i];
-	  (*pFlash)=CalDCO[i];
-	  pFlash++;
-	  (*pFlash)=CalBC1[i];
-      }
-
- // End flash operation
  FCTL1 = FWKEY; // Clear WRT bit
  FCTL3 = FWKEY + LOCK; // Set LOCK bit
 
+ // Return to DCO near 1MHz
+ set1MHz();
+
  eint(); // Enable interrupts
  }
 
+// Measures all the DCO points and writes the dense map
+// Each difference is taken from the value the reader will
+// build, so the rounding errors do not add up
+// Returns the number of differences out of range
+int mapBuild()
+ {
+ int rsel,dco,l,q,k=0,clamped=0;
+ unsigned char bc2;
+ int last=0;
+ uint16_t words[NCAL_MAP_WORDS];
+ signed char *diff=(signed char *) (words+1);
+
+ // MCLK is DCO/2, SMCLK still counts the DCO
+ bc2=BCSCTL2;
+ BCSCTL2=bc2|DIVM_1;
+
+ // The first point settles from the last calibration
+ // frequency, it is measured once more in the loop
+ mapHz(NCAL_MAP_RSEL0,0);
+
+ for(rsel=NCAL_MAP_RSEL0;rsel<16;rsel++)
+	 for(dco=0;dco<8;dco++)
+	     {
+		 l=ncal_log2q8(mapHz(rsel,dco));
+		 if (k)
+		     {
+			 q=l-last;
+			 if ((q>127)||(q<-128))
+			     {
+				 q=(q>0)?127:-128;
+				 clamped++;
+			     }
+			 diff[k-1]=q;
+			 last+=q;
+		     }
+		    else
+			 words[0]=last=l;
+		 k++;
+		 P1OUT^=LED_GREEN;
+	     }
+
+ // Padding byte
+ diff[NCAL_MAP_NPTS-1]=-1;
+
+ BCSCTL2=bc2;
+
+ mapWrite(words);
+
+ #ifdef TELEMETRY
+ txChar('A');
+ txNum(clamped);
+ txEnd();
+ #endif
+
+ return clamped;
+ }
+
+#endif // MAP_BUILD
+
+#ifdef LOOP_SLEEP
+
+// Sets the interrupts of the loop sleep mode
+// If gates is true the captures run for a measurement
+// If not, only the slow watchdog interval interrupts
+// In ACLK_CAPTURE mode the capture interrupt is never used
+void loopTiming(int gates)
+ {
+ if (gates)
+     {
+	 loopSlow=0;
+	 WDTCTL=WDT_ADLY_1_9;
+	 #ifndef ACLK_CAPTURE
+	 SET_FLAG(TACCTL0,CCIE);
+	 #endif
+     }
+    else
+     {
+	 #ifndef ACLK_CAPTURE
+	 RESET_FLAG(TACCTL0,CCIE);
+	 #endif
+	 WDTCTL=LOOP_WDT;
+	 loopSlow=1;
+	 SET_FLAG(IE1,WDTIE);
+     }
+ }
+
+#endif // LOOP_SLEEP
 
-// Loop through all the frequencies
+// Loop through all the frequencies with data
 // If flash is true, it loops through flash data
 // If not, it loops thorugh RAM data
-// Never returns
+// Never returns, unless no frequency has data
 void loopFrequencies(int flash)
  {
  int i;
  unsigned char *pFlash;
 
+ // Nothing to loop
+ if (!calAny(flash)) return;
+
  // Turn On Green Led
  SET_FLAG(P1OUT,LED_GREEN);
 
+ #ifdef TELEMETRY
+ txChar('L');
+ txNum(flash);
+ txEnd();
+ #endif
+
  // DCO is set for SMCLK
 
  // Enable TAR Timer Overflow Interrupt
  // Used to blink the green led
+ // In LOOP_SLEEP mode the watchdog blinks it
+ #ifndef LOOP_SLEEP
  SET_FLAG(TACTL,TAIE);
+ #endif
 
  // Program SWITCH as input with pull-up
  RESET_FLAG(P1DIR,SWITCH);    // Input mode
  SET_FLAG(P1OUT,SWITCH);      // Output "1" for Pull-Up
  SET_FLAG(P1REN,SWITCH);      // Resistor Enable
 
+ // Switch interrupt on the falling edge
+ // and slow watchdog, the captures are stopped
+ #ifdef LOOP_SLEEP
+ SET_FLAG(P1IES,SWITCH);
+ RESET_FLAG(P1IFG,SWITCH);
+ SET_FLAG(P1IE,SWITCH);
+ loopTiming(0);
+ #endif
+
+ // First frequency with data
  i=0;
+ while ((i<NFREQ-1)&&calEmpty(flash,i)) i++;
+
  while (1) // Do forever
        {
 	   if (flash)
 	       {
 		   // Set the frequency from flash
-		   pFlash = (unsigned char *) CalPos[i];
-		   DCOCTL=*pFlash;
-		   pFlash++;
-		   BCSCTL1=*pFlash;
+		   pFlash = calPtr(i);
+		   dco_set(pFlash[0],pFlash[1]);
 		   }
 	      else
 	      {
 	      // Set the frequency form memory table
-	      DCOCTL=CalDCO[i];
-	      BCSCTL1=CalBC1[i];
+	      dco_set(CalDCO[i],CalBC1[i]);
 	      }
 
+       #ifdef LOOP_SLEEP
+	   // Turn Off Red Led
+	   RESET_FLAG(P1OUT,LED_RED);
+
+	   // Sleep until the switch is pressed
+	   // The interrupts debounce it
+	   // Correcting the drift if enabled
+	   pressed=0;
+	   while (!pressed)
+	       {
+		   dint();
+		   while (!LOOP_WAKE)
+		       {
+			   __bis_SR_register(LOOP_LPM+GIE);
+			   dint();
+		       }
+		   eint();
+
+           #ifdef DRIFT_CORRECT
+		   if (loopTicks>=DRIFT_TICKS)
+		       {
+			   loopTicks=0;
+			   loopTiming(1);
+			   driftCorrect(i);
+			   loopTiming(0);
+		       }
+           #endif
+	       }
+       #else
 	   // Wait to release switch if was pressed
-	   while (!(P1IN&SWITCH)) {};
+	   while (!(P1IN&SWITCH)) waitGate();
 
 	   // Turn Off Red Led
 	   RESET_FLAG(P1OUT,LED_RED);
 
 	   // Loops for several captures to debounce
 	   ncap=0;
-	   while (ncap<200) {};
+	   waitCaptures(200);
 
 	   // Wait to press switch
-	   while (P1IN&SWITCH) {};
+	   // Correcting the drift if enabled
+	   while (P1IN&SWITCH)
+	       {
+		   waitGate();
+           #ifdef DRIFT_CORRECT
+		   if (ncap>=(NCAP+DRIFT_PERIOD)) driftCorrect(i);
+           #endif
+	       }
+       #endif
 
 	   // Turn On Red Led
 	   SET_FLAG(P1OUT,LED_RED);
 
 	   // Increase frequency
-	   i++;
-	   if (i>=NFREQ) i=0;
+	   // Frequencies without data are skipped
+	   do
+	     {
+		 i++;
+		 if (i>=NFREQ) i=0;
+	     }
+	     while (calEmpty(flash,i));
 	   }
  }
 
-// Main function
-int main()
+#ifdef FREQ_COUNTER
+
+// Measures the frequency of the signal at the TA0CLK pin
+// COUNT_NMEAS measurements of NCAP gates are added
+// Returns the frequency in Hz
+unsigned long countHz()
  {
- int i,j,error;
+ int k;
+ unsigned long sum=0,q,r;
 
- // Disable the watchdog.
- WDTCTL = WDTPW + WDTHOLD;
+ // Timer A counts the external edges
+ SET_FLAG(P1SEL,COUNT_PIN);
+ TACTL=TASSEL_0+ID_0+MC_2;
 
- // Configure all the peripherals
- configureAll();
+ for(k=0;k<COUNT_NMEAS;k++)
+     {
+	 startMeasure(1);
+	 waitCaptures(NCAP);
+	 sum+=Mean;
+     }
 
- // Enable interrupts
- eint();
+ // Timer A counts SMCLK again
+ TACTL=TASSEL_2+ID_0+MC_2;
 
- // Flash is tested to be empty if
- // test mode and flash override are not selected
- #ifndef TEST_MODE
-   #ifndef FLASH_OVERRIDE
-      // Test if the zone to program is empty
-      if (testFlashEmpty())
-          {
-    	  // Loop from flash if data found
-          loopFrequencies(1);
-          }
-   #endif
+ // P1.0 stays an input
+ RESET_FLAG(P1SEL,COUNT_PIN);
+
+ // Hz is sum*32768/(gates*GATE_CYCLES) without overflow
+ // The counts of each gate fit in 16 bits
+ q=sum/(NCAP*COUNT_NMEAS);
+ r=sum%(NCAP*COUNT_NMEAS);
+ return (q*32768UL)/GATE_CYCLES
+		 +(r*32768UL)/((unsigned long)GATE_CYCLES*NCAP*COUNT_NMEAS);
+ }
+
+// Sends one frequency measurement
+void txCount()
+ {
+ txChar('H');
+ txNum(countHz());
+ txEnd();
+ }
+
+// Frequency counter mode
+// Blinks the green led after each measurement
+// Never returns
+void counterLoop()
+ {
+ while (1)
+     {
+	 txCount();
+	 P1OUT^=LED_GREEN;
+     }
+ }
+
+#endif // FREQ_COUNTER
+
+// Calibrates the selected frequencies
+// The data of the rest is copied from flash
+// Ends with the DCO near 1MHz
+void calibrate()
+ {
+ int i,j,error;
+ #if defined(LONG_GATE) || defined(TELEMETRY)
+ long int ppm;
+ #endif
+
+ #ifdef TELEMETRY
+ txChar('S');
+ txNum(NFREQ);
+ txNum(FreqMask);
+ txEnd();
+ #endif
+
+ // Nothing is kept from a previous calibration
+ // (COMMAND_MODE can calibrate several times)
+ FlashN=0;
+ SlowN=0;
+ #ifdef WARM_START
+ startRsel=0;
+ startDco=0;
+ #endif
+ #ifdef MEASURE_CACHE
+ cacheClear();
+ #endif
+ #ifdef CHAR_SWEEP
+ RowRsel=-1;
+ #endif
+
+ // Characterise the DCO
+ #ifdef CHAR_SWEEP
+ charSweep();
  #endif
 
  // Search for each frequency
  for(i=0;i<NFREQ;i++)
     {
+	// Not selected frequencies keep the old data
+	if (!(FreqMask&(1UL<<i)))
+	    {
+        #ifdef TEST_MODE
+		CalDCO[i]=0xFF;
+		CalBC1[i]=0xFF;
+        #else
+		CalDCO[i]=calPtr(i)[0];
+		CalBC1[i]=calPtr(i)[1];
+        #endif
+		continue;
+	    }
+
 	// If clock fault, generate error 1
 	if (BCSCTL3&LFXT1OF) errorLock(1);
 
     // Blinks green led
 	ledBlink(LED_GREEN);
 
+	// Count the setDCO calls of this frequency
+    #if defined(TELEMETRY) || defined(INSTRUMENT)
+	nsets=0;
+    #endif
+    #ifdef INSTRUMENT
+	instStart();
+    #endif
+
 	// Search for each frequency
 	for(j=0;j<MAX_CYCLES;j++)
 	    {
         // Blinks red led if repeating
-	    if (j) ledBlink(LED_GREEN+LED_RED);
-
-	    // Error lock 2 if cannot adquire frequency
-        if (searchGoal(GoalN[i])) errorLock(2);
+	    if (j)
+	        {
+	    	ledBlink(LED_GREEN+LED_RED);
+
+	    	// Measure again the out of tolerance result
+            #ifdef MEASURE_CACHE
+	    	cacheDrop();
+            #endif
+	        }
+
+        #ifdef LOCAL_RETRY
+	    if (j)
+	        {
+	    	// Search again near the previous result
+	    	if (refineGoal(GoalN[i],dco*DCO0+mod,RETRY_RANGE))
+	    		if (searchGoal(GoalN[i])) errorLock(2);
+	        }
+	       else
+        #endif
+	        {
+	    	// Try first the sweep result, retries search
+            #ifdef CHAR_SWEEP
+	    	if ((j)||charCheck(i))
+            #endif
+	    	// Then try near the factory seed
+            #ifdef FACTORY_SEED
+	    	if (seedSearch(i))
+            #endif
+	    	// Error lock 2 if cannot adquire frequency
+	    	if (searchGoal(GoalN[i])) errorLock(2);
+	        }
 
         // Compute frequency error in %
+        #ifdef LONG_GATE
+	    ppm=longError(i);
+	    error=(char)(ppm/10000);
+        #else
 	    error=(char)((100*((long int)AveragedDifference-(long int)GoalN[i]))/GoalN[i]);
+        #endif
 	    if ((error<=MAX_ERROR)&&(error>=(-MAX_ERROR))) break;
 	    }
 
@@ -601,7 +3181,23 @@ int main()
 
 	// Store calibration data
 	CalDCO[i]=DCOCTL;
-	CalBC1[i]=BCSCTL1;
+	CalBC1[i]=BCSCTL1&DIVA_MASK;  // Without the ACLK divider
+
+	// Keep the frequency nearest to 1MHz
+	if (DIST_1MHZ(AveragedDifference)<DIST_1MHZ(SlowN))
+	    {
+		SlowN=AveragedDifference;
+		SlowDCO=CalDCO[i];
+		SlowBC1=CalBC1[i];
+	    }
+
+	// Keep the fastest frequency for flash timing
+	if (AveragedDifference>FlashN)
+	    {
+		FlashN=AveragedDifference;
+		FlashDCO=CalDCO[i];
+		FlashBC1=CalBC1[i];
+	    }
 
 	// Store debug information if enabled
     #ifdef DEBUG
@@ -609,13 +3205,241 @@ int main()
       FoundDco[i]=dco;
 	  FoundMod[i]=mod;
 	  FoundErr[i]=error;
+      #ifdef LONG_GATE
+	  FoundPpm[i]=ppm;
+      #endif
 	#endif
+
+	// Send the result
+	// The lines wait for space as no measurement runs now
+    #ifdef TELEMETRY
+	  txWait++;
+      #ifndef LONG_GATE
+	  ppm=txPpm(i);
+      #endif
+	  txFreq(i,ppm);
+    #endif
+
+	// Store the counters of this frequency
+    #ifdef INSTRUMENT
+	  instEnd(i,j);
+    #endif
+    #ifdef TELEMETRY
+	  txWait--;
+    #endif
+
+	// Next frequency search starts from this one
+    #ifdef WARM_START
+      startRsel=rsel;
+      startDco=dco;
+    #endif
+    }
+
+ // Return to DCO near 1MHz
+ set1MHz();
+ }
+
+#ifdef COMMAND_MODE
+
+// Reads the decimal number after the command letter
+unsigned long cmdNum(char *ptr)
+ {
+ unsigned long x=0;
+
+ ptr++;
+ if ((*ptr)==',') ptr++;
+ while (((*ptr)>='0')&&((*ptr)<='9'))
+	x=10*x+((*(ptr++))-'0');
+
+ return x;
+ }
+
+// Measures the stored data of the selected frequencies
+void cmdVerify()
+ {
+ int i;
+ unsigned int n;
+
+ for(i=0;i<NFREQ;i++)
+     {
+	 if ((!(FreqMask&(1UL<<i)))||calEmpty(1,i)) continue;
+	 n=verifyCount(i);
+	 txChar('V');
+	 txNum(i);
+	 txNum(n);
+	 txNum(GoalN[i]);
+	 txNum((1000000L*((long int)n-(long int)GoalN[i]))/GoalN[i]);
+	 txEnd();
+     }
+
+ // Return to DCO near 1MHz
+ set1MHz();
+ }
+
+// Sends the stored data of all frequencies
+void cmdDump()
+ {
+ int i;
+ unsigned char *ptr;
+
+ for(i=0;i<NFREQ;i++)
+     {
+	 ptr=calPtr(i);
+	 txChar('D');
+	 txNum(i);
+	 txNum(FreqHz[i]);
+	 txNum(ptr[0]);
+	 txNum(ptr[1]);
+	 txEnd();
+     }
+ }
+
+// Executes the host commands
+// Never returns
+void cmdLoop()
+ {
+ char ok;
+
+ // Replies are not sent during a measurement
+ // so no character is lost
+ txWait=1;
+
+ while (1)
+    {
+	// Wait for a command line
+	while (!rxReady) waitGate();
+
+	ok=1;
+	switch (RxLine[0])
+	    {
+	    case 'M': // Select frequencies
+	    	FreqMask=cmdNum(RxLine)&FREQ_ALL;
+	    	break;
+	    case 'C': // Calibrate
+	    	calibrate();
+            #ifndef TEST_MODE
+	    	calDone=1;
+            #endif
+	    	break;
+	    case 'V': // Verify
+	    	cmdVerify();
+	    	break;
+	    case 'D': // Dump
+	    	cmdDump();
+	    	break;
+	    case 'W': // Write to flash
+	    	if (!calDone)
+	    	    {
+	    		ok=0;
+	    		break;
+	    	    }
+	    	testFlashEmpty();   // Sets flashErase if needed
+	    	flashWrite();
+	    	txChar('W');
+	    	txNum(txMs());
+	    	txNum(txLost);
+	    	txEnd();
+            #ifdef INSTRUMENT
+	    	txGlobal();
+            #endif
+	    	break;
+        #ifdef FREQ_COUNTER
+	    case 'H': // Frequency count
+	    	txCount();
+	    	break;
+        #endif
+        #ifdef MAP_BUILD
+	    case 'A': // Dense DCO map
+	    	mapBuild();
+	    	break;
+        #endif
+	    case 'L': // Loop frequency mode
+	    	if (!calAny(1))
+	    	    {
+	    		ok=0;
+	    		break;
+	    	    }
+	    	txChar('K');
+	    	txEnd();
+	    	loopFrequencies(1);
+	    	break;
+	    default:
+	    	ok=0;
+	    }
+
+	// Command done
+	txChar(ok?'K':'?');
+	txEnd();
+	rxReady=0;
     }
+ }
+
+#endif // COMMAND_MODE
+
+// Main function
+int main()
+ {
+ // Disable the watchdog.
+ WDTCTL = WDTPW + WDTHOLD;
+
+ // Configure all the peripherals
+ configureAll();
+
+ // Select the frequencies with the strap
+ #ifdef STRAP_SELECT
+ readStrap();
+ #endif
+
+ // Select the set of the current temperature
+ #ifdef TEMP_BINS
+ readTemp();
+ #endif
+
+ // Enable interrupts
+ eint();
+
+ // Find the newest calibration record
+ // or check the header of the data
+ #ifndef TEST_MODE
+   #ifdef APPEND_RECORDS
+   recFind();
+   #elif defined(TEMP_BINS)
+   calValid=ncal_valid_bin(tempBin);
+   #else
+   calValid=ncal_valid();
+   #endif
+ #endif
+
+ // Commands from the host or frequency counter
+ // Never returns
+ #ifdef COMMAND_MODE
+ cmdLoop();
+ #elif defined(FREQ_COUNTER)
+ counterLoop();
+ #endif
 
- // Return to calibrated DCO data for 1MHz
- DCOCTL=CALDCO_1MHZ;    // DCOCTL   Cal. data for 1MHz
- BCSCTL1=CALBC1_1MHZ;   // BCSCTL1  Cal. data for 1MHz
+ // Flash is tested to be empty if
+ // test mode and flash override are not selected
+ #ifndef TEST_MODE
+   #ifndef FLASH_OVERRIDE
+      // Test if the zone to program is empty
+      if (testFlashEmpty())
+          {
+          #ifdef VERIFY_MODE
+    	  // Loop from flash if data is verified
+    	  // If not, recalibrate the failing frequencies
+          if (!verifyFlash()) loopFrequencies(1);
+          flashErase=1;
+          #else
+    	  // Loop from flash if data found
+          loopFrequencies(1);
+          #endif
+          }
+   #endif
+ #endif
 
+ // Calibrate the selected frequencies
+ calibrate();
 
  #ifdef TEST_MODE
   // Loop from ram table
@@ -625,11 +3449,26 @@ int main()
  // Write the flash
  flashWrite();
 
+ #ifdef TELEMETRY
+ txChar('W');
+ txNum(txMs());
+ txNum(txLost);
+ txEnd();
+   #ifdef INSTRUMENT
+   txGlobal();
+   #endif
+ #endif
+
+ // Measure and write the dense DCO map
+ #ifdef MAP_BUILD
+ mapBuild();
+ #endif
+
  // Loop from flash
  loopFrequencies(1);
 
- // We should never arrive to this point
- // as loopFrequencies never returns
+ // We only arrive to this point if no
+ // frequency has data to loop
 
  // Locks with green led
  SET_FLAG(P1OUT,LED_GREEN);
@@ -641,48 +3480,316 @@ int main()
 
 /********************** RSI FUNCTIONS *******************/
 
+#ifdef RING_FILTER
+
+// Stores a captured difference in the ring buffer
+// Returns the median of the stored differences
+// Called from the capture ISR
+unsigned int ringFilter(unsigned int x)
+ {
+ unsigned int v[RING_SIZE];
+ unsigned int t;
+ int i,j;
+
+ // Store the difference
+ Ring[ringPos]=x;
+ ringPos++;
+ if (ringPos>=RING_SIZE) ringPos=0;
+ if (nring<RING_SIZE) nring++;
+
+ // Sort a copy of the stored differences
+ for(i=0;i<nring;i++)
+     {
+	 t=Ring[i];
+	 for(j=i;(j>0)&&(v[j-1]>t);j--)
+		 v[j]=v[j-1];
+	 v[j]=t;
+     }
+
+ // Median, uses the two central ones for an even number
+ if (nring&1) return v[nring>>1];
+ return v[(nring>>1)-1]+((v[nring>>1]-v[(nring>>1)-1])>>1);
+ }
+
+#endif // RING_FILTER
+
+// Processes the capture that ends a gate
+// Called from the capture ISR, or from the Watchdog ISR
+// in ACLK_CAPTURE mode, and computes the diference between captures
+// Returns true if the ISR must wake the CPU
+int gateCapture(unsigned int capture)
+ {
+ #ifdef ADAPTIVE_NCAP
+ int d;
+ #endif
+ #ifdef LONG_GATE
+ unsigned int h;
+ unsigned long c;
+ #endif
+ #ifdef SETTLE_DETECT
+ unsigned int prev,delta;
+ #endif
+ unsigned int diff;
+
+ // Time from start in ACLK cycles
+ #ifdef TELEMETRY
+   #ifdef LONG_GATE
+   Ticks+=longGate?LONG_CYCLES:GATE_CYCLES;
+   #else
+   Ticks+=GATE_CYCLES;
+   #endif
+ #endif
+
+ #ifdef LONG_GATE
+ if (longGate)
+     {
+	 // Extend the capture to 32 bits
+	 // If an overflow is pending and the capture is low
+	 // the overflow happened before the capture
+	 h=TarHigh;
+	 if ((TACTL&TAIFG)&&(capture<0x8000)) h++;
+	 c=(((unsigned long)h)<<16)+capture;
+	 LongDifference=c-LastLong;
+	 LastLong=c;
+     }
+ #endif
+
+ #ifdef SETTLE_DETECT
+ prev=LastDifference;
+ #endif
+
+ // Current distance between captures
+ LastDifference=capture-LastCapture;
+ // Current last capture
+ LastCapture=capture;
+
+ #ifdef SETTLE_DETECT
+ // Start averaging when two consecutive captures agree
+ if (settle)
+     {
+	 if (ncap<0)
+	     {
+		 ndisc++;
+		 if (ndisc>SETTLE_MIN)
+		     {
+			 delta=(LastDifference>prev)?(LastDifference-prev):(prev-LastDifference);
+			 if (delta<=(LastDifference>>SETTLE_SHIFT)) ncap=0;
+		     }
+	     }
+	 if (ncap>=0) settle=0;
+     }
+ #endif
+
+ // Count the gates of the frequency
+ #ifdef INSTRUMENT
+ if (ncap<0)
+	 instDisc++;
+    else if (ncap<NCAP)
+	 instGates++;
+ #endif
+
+ if (ncap>=0)
+	  if (ncap<NCAP)
+	     {
+         #ifdef RING_FILTER
+		 // Average the median of the last captures
+		 if (!ncap) nring=ringPos=0;
+		 diff=ringFilter(LastDifference);
+         #else
+		 diff=LastDifference;
+         #endif
+
+		 Mean+=diff;
+
+         #ifdef ADAPTIVE_NCAP
+		 // Sums for the variance
+		 // Differences are limited so their squares fit in 16 bits
+		 if (!ncap) RefDifference=diff;
+		 d=diff-RefDifference;
+		 if (d>127) d=127;
+		 if (d<-127) d=-127;
+		 S1+=d;
+		 S2+=(unsigned int)(d*d);
+         #endif
+
+         #ifdef DECISION_MODE
+		 if (DecisionGoal)
+		     {
+			 // Count captures clearly over or under goal
+			 if (diff>(DecisionGoal+DecisionMargin))
+				 nside++;
+			 if (diff<(DecisionGoal-DecisionMargin))
+				 nside--;
+
+			 // If not all captures are on the same side
+			 // do the full average
+			 if ((nside!=(ncap+1))&&(nside!=-(ncap+1)))
+				 DecisionGoal=0;
+			    else
+				 // End measurement if we have enough captures
+				 if ((ncap+1)>=DEC_NCAP)
+				     {
+					 nmean=ncap+1;
+					 ncap=NCAP;
+				     }
+		     }
+         #endif
+	     }
+
+ // We don't want to roll over
+ if (ncap<10000) ncap++;
+
+ // Wake the CPU if waiting for this capture
+ #ifdef LOW_POWER_WAIT
+ return (ncap>=ncapWake);
+ #else
+ return 0;
+ #endif
+ }
+
 // Watchdog timer interrupt
 // Called each 64/fCLK32 period (1,9ms)
 // Generates a capture in module 0 of timer 0
 // each time it is called.
+// In ACLK_CAPTURE mode it reads the capture
+// latched by the last ACLK edge instead
 interrupt(WDT_VECTOR) WDT_ISR(void)
  {
+ #ifdef ACLK_CAPTURE
+ // Read first, before the next ACLK edge
+ unsigned int capture=TACCR0;
+ #endif
+
  // Don't need to clear any flag
 
+ // Slow interval of the loop sleep mode
+ // Blinks the green led and debounces the switch
+ #ifdef LOOP_SLEEP
+ if (loopSlow)
+     {
+	 P1OUT^=LED_GREEN;
+
+	 // Enable the switch again when released long enough
+	 if (!(P1IE&SWITCH))
+	     {
+		 if (!(P1IN&SWITCH))
+			 debounce=DEBOUNCE_TICKS;
+		    else if (debounce)
+			 debounce--;
+		    else
+		     {
+			 RESET_FLAG(P1IFG,SWITCH);
+			 SET_FLAG(P1IE,SWITCH);
+		     }
+	     }
+
+	 // Wake the loop for the drift correction
+     #ifdef DRIFT_CORRECT
+	 if ((++loopTicks)>=DRIFT_TICKS) __bic_SR_register_on_exit(LPM3_bits);
+     #endif
+	 return;
+     }
+ #endif
+
  // Toggle Fout
  P1OUT^=F_OUT;
 
+ #ifdef ACLK_CAPTURE
+ if (gateCapture(capture)) __bic_SR_register_on_exit(LPM0_bits);
+ #else
  // Generate a capture by changing the capture
  // input between Vdd and GND using CCIS0
  TACCTL0^=CCIS0;
+ #endif
  }
 
-// Capture 0 interrupt
+// Capture 0 interrupt (Not in ACLK_CAPTURE mode)
 // A capture is generated each time the
 // Watchdog timer overflows
-// The RSI computes the diference between captures
+#ifndef ACLK_CAPTURE
 interrupt(TIMER0_A0_VECTOR) CAPTURE0_ISR(void)
  {
- // Don't need to clear any flag
+ if (gateCapture(TACCR0)) __bic_SR_register_on_exit(LPM0_bits);
+ }
+#endif
 
- // Current distance between captures
- LastDifference=TACCR0-LastCapture;
- // Current last capture
- LastCapture=TACCR0;
+// UART transmit interrupt (Only in TELEMETRY mode)
+// Sends the next character of the ring buffer
+// and disables itself when the buffer is empty
+#ifdef TELEMETRY
+interrupt(USCIAB0TX_VECTOR) UART_TX_ISR(void)
+ {
+ if (txTail!=txHead)
+     {
+	 UCA0TXBUF=TxBuf[txTail];
+	 txTail=(txTail+1)&(TX_SIZE-1);
+     }
+ if (txTail==txHead) RESET_FLAG(IE2,UCA0TXIE);
+ }
+#endif
 
- if (ncap>=0)
-	  if (ncap<NCAP)
-		 Mean+=LastDifference;
+// UART receive interrupt (Only in COMMAND_MODE)
+// Stores a command line until CR or LF
+// Characters are ignored until the previous command ends
+#ifdef COMMAND_MODE
+interrupt(USCIAB0RX_VECTOR) UART_RX_ISR(void)
+ {
+ char c;
 
- // We don't want to roll over
- if (ncap<10000) ncap++;
+ c=UCA0RXBUF;
+ if (rxReady) return;
+
+ if ((c=='\r')||(c=='\n'))
+     {
+	 // Empty lines are ignored
+	 if (!rxPos) return;
+	 RxLine[rxPos]=0;
+	 rxPos=0;
+	 rxReady=1;
+	 return;
+     }
+
+ if (rxPos<(RX_SIZE-1)) RxLine[rxPos++]=c;
+ }
+#endif
+
+// Timer1_A3 ISR (Only in INSTRUMENT mode)
+// Counts the overflows of the ACLK time
+#ifdef INSTRUMENT
+interrupt(TIMER1_A1_VECTOR) Timer1_ISR(void)
+ {
+ if (TA1IV==TA1IV_TAIFG) instHigh++;
  }
+#endif
+
+// Port 1 interrupt (Only in LOOP_SLEEP mode)
+// The switch is pressed, it is disabled until the watchdog
+// finds it released and wakes the loop
+#ifdef LOOP_SLEEP
+interrupt(PORT1_VECTOR) Port1_ISR(void)
+ {
+ if (P1IFG&SWITCH)
+     {
+	 RESET_FLAG(P1IE,SWITCH);
+	 RESET_FLAG(P1IFG,SWITCH);
+	 debounce=DEBOUNCE_TICKS;
+	 pressed=1;
+	 __bic_SR_register_on_exit(LPM3_bits);
+     }
+ }
+#endif
 
 // General Timera A0 ISR
 interrupt(TIMER0_A1_VECTOR) Timer0_ISR(void)
  {
  if (TA0IV==TA0IV_TAIFG)
       {
+      // Count overflows during a long gate
+      #ifdef LONG_GATE
+	  TarHigh++;
+	  if (longGate) return;
+      #endif
+
 	  bcount++;
 	  if (bcount>=10)
 	      {